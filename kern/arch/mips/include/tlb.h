@@ -49,23 +49,32 @@
  *        was found. ENTRYLO is not actually used, but must be set; 0
  *        should be passed.
  *
+ *   tlb_setpid: load ENTRYHI without touching the TLB. Lookups only
+ *        match entries whose PID field equals the one in ENTRYHI, so
+ *        this selects the current address space ID. Note that all the
+ *        functions above leave ENTRYHI set to the value passed.
+ *
  *        IMPORTANT NOTE: An entry may be matching even if the valid bit
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
  */
 
+/* This header is also included by the TLB refill handler in locore. */
+#ifndef __ASSEMBLER__
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setpid(uint32_t entryhi);
+#endif
 
 /**
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
+ * Note that the MIPS has support for a 6-bit address space ID. The VM
+ * system tags user entries with it through TLBHI_PID so they survive
+ * context switches. TLBLO_GLOBAL can be left always zero, as can the
  * bits that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
@@ -80,7 +89,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
  * Fields in the high-order word
  */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /**
  * Fields in the low-order word (page table entry)
@@ -100,7 +110,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 #define TLBLO_INVALID()        (0)
 
 /*
- * Number of TLB entries in the processor.
+ * Number of TLB entries in the processor. A power of two, as the fast
+ * refill handler wraps its round-robin hand with NUM_TLB - 1.
  */
 
 #define NUM_TLB  64
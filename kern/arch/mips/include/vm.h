@@ -91,9 +91,21 @@ kvaddr_to_paddr(vaddr_t vaddr){
  *
  * We put the stack at the very top of user virtual memory because it
  * grows downwards.
+ *
+ * The stack region starts out USERSTACKSIZE bytes long and is grown
+ * down by faults within USERSTACKREACH bytes below it, up to
+ * USERSTACKMAX bytes. The reach allows for a function touching the
+ * far end of a large stack frame first; faults further down are wild
+ * pointers and are not taken as stack growth. The heap is
+ * kept USERSTACKGUARD bytes clear of the stack, and mappings are kept
+ * that far below its limit, so running off the end of the stack faults
+ * rather than scribbling on them.
  */
-#define USERSTACK     USERSPACETOP
-#define USERSTACKSIZE (16 * PAGE_SIZE) // Stack has size 16 pages
+#define USERSTACK      USERSPACETOP
+#define USERSTACKSIZE  (1 * PAGE_SIZE)    // Initial stack size, 1 page
+#define USERSTACKMAX   (1024 * PAGE_SIZE) // Largest stack, 4MB
+#define USERSTACKGUARD (16 * PAGE_SIZE)   // Gap kept below the stack
+#define USERSTACKREACH (16 * PAGE_SIZE)   // Furthest below it a fault grows it
 
 /*
  * Interface to the low-level module that looks after the amount of
@@ -122,19 +134,29 @@ paddr_t ram_stealmem(unsigned long npages);
 paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
 
+/*
+ * CPUs the VM keeps TLB state for. System/161 has at most 32.
+ */
+#define VM_CPUS 32
+
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown carries a batch of pages of one address space (struct
+ * tlbbatch, see vm.h). We'll take up to 16 pages in a batch before just
+ * dropping all of the address space's entries instead. Whoever sends a
+ * shootdown waits for it to be handled, but may be preempted meanwhile,
+ * so a CPU can be sent more than it has room for. A sender finding the
+ * queue full sends again once the target has made room.
  */
 
+struct tlbbatch;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct tlbbatch *ts_batch;	/* pages to drop, and who is left */
 };
 
-#define TLBSHOOTDOWN_MAX 16
+#define TLBSHOOTDOWN_MAX 32
+#define TLBSHOOTDOWN_PAGES 16
 
 #endif /* _MIPS_VM_H_ */
@@ -37,6 +37,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -143,6 +144,53 @@ syscall(struct trapframe *tf)
 		break;
 
 
+	    /* VM calls */
+
+#if !OPT_DUMBVM
+	    case SYS_sbrk:
+		{
+			vaddr_t oldbreak;
+
+			err = sys_sbrk((intptr_t)tf->tf_a0, &oldbreak);
+			if (!err) {
+				retval = (int32_t)oldbreak;
+			}
+		}
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * The offset is 64 bits wide and a2 is taken
+			 * by fd, so it is passed on the stack.
+			 */
+			off_t offset;
+			vaddr_t addr;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       offset, &addr);
+			if (!err) {
+				retval = (int32_t)addr;
+			}
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+
+	    case SYS___vmstat:
+		err = sys___vmstat(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+#endif
+
+
 	    /* file calls */
 
 	    case SYS_open:
@@ -28,10 +28,19 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <swap.h>
+#include <vmstat.h>
+#include <textcache.h>
+#include <ptcache.h>
+#include <wchan.h>
 
 vaddr_t firstfree;   /* first free virtual address; set by start.S */
 
@@ -40,15 +49,135 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 
 
 
+/*
+ * Reverse map, from a user frame to the page table entries mapping it.
+ * A frame mapped once, the common case, records the mapping in its
+ * frame table entry (as and vaddr). A frame shared by several address
+ * spaces, after fork() or through the text cache, keeps one mapping
+ * there and the rest on a list of rmap entries. Mappings of the shared
+ * zero page are not recorded.
+ */
+struct rmap {
+        struct rmap *rm_next;
+        struct addrspace *rm_as;
+        vaddr_t rm_vaddr;
+};
+
 typedef struct ft_entry {
         unsigned allocated:1; /* the corresponding frame is allocated */
         unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        unsigned pinned:1; /* the frame must not be evicted */
+        unsigned free_head:1; /* the frame starts a free buddy block */
+        unsigned order:5; /* log2 of the free block's size in frames */
+        unsigned refcount:23; /* number of users sharing the frame */
+        struct addrspace *as; /* address space mapping a user frame, or NULL */
+        vaddr_t vaddr; /* user address the frame is mapped at in as */
+        struct rmap *rmap; /* further mappings of a shared user frame */
+        uint32_t next_free; /* free list links of a free block head */
+        uint32_t prev_free;
 } ft_entry_t;
 
 
 static ft_entry_t * frame_table = NULL; /* base of frame table */
 static uint32_t first_frame;
 static uint32_t last_frame;
+static uint32_t clock_hand; /* next frame considered for eviction */
+
+static struct ptcache *rmap_cache; /* rmap entries */
+
+/*
+ * Free frames are kept by a binary buddy allocator. A free block of
+ * order k is 2^k frames starting at a frame number that is a multiple
+ * of 2^k; its buddy is the block the frame number differs from in bit
+ * k. Each order has a doubly linked free list threaded through the
+ * frame table entries of the block heads.
+ */
+#define BUDDY_ORDERS 18              /* enough for 512M of 4k frames */
+#define BUDDY_NONE ((uint32_t) -1)   /* end of a free list */
+
+static uint32_t buddy_free_list[BUDDY_ORDERS]; /* first block of each order */
+static unsigned buddy_free_count[BUDDY_ORDERS]; /* blocks of each order */
+static unsigned buddy_frames; /* frames in all the free blocks */
+
+static void buddy_push(uint32_t i, unsigned order);
+
+/* page replacement statistics */
+static unsigned clock_sweeps;    /* times the clock hand went all the way round */
+static unsigned clock_scanned;   /* frames the clock hand looked at */
+static unsigned clock_reclaimed; /* frames taken by paging out their page */
+
+/*
+ * Pool of frames zeroed ahead of time, so page faults on anonymous
+ * memory need not zero a frame themselves. Pool frames are allocated
+ * but have no owner, so they are never evicted; when free memory runs
+ * out they are handed out before anything is paged out.
+ *
+ * The frames are zeroed by a kernel thread that only runs when the
+ * idle loop wakes it, one frame per wakeup, so the zeroing uses idle
+ * time but is done with interrupts on.
+ */
+#define ZERO_POOL_SIZE 32   /* frames kept zeroed */
+
+static paddr_t zero_pool[ZERO_POOL_SIZE];
+static unsigned zero_pool_count;  /* frames in the pool */
+static unsigned zero_pool_hits;   /* zeroed frames taken from the pool */
+static unsigned zero_pool_misses; /* zeroed frames that had to be zeroed */
+
+static struct spinlock zero_pool_lock = SPINLOCK_INITIALIZER;
+static struct wchan *zero_pool_wchan;  /* the zeroing thread sleeps here */
+static int zero_pool_running;          /* the thread has started */
+static int zero_pool_sleeping;         /* and is waiting to be woken */
+
+/*
+ * Per-CPU caches of free frames in front of the buddy allocator, so
+ * single frame allocations and frees normally only take the local
+ * cache's lock rather than frame_table_spinlock. Caches are refilled
+ * from and drained to the buddy allocator in batches.
+ *
+ * Cached frames look allocated with a single reference and no owner,
+ * so neither the buddy allocator nor the clock hand touches them.
+ */
+#define FRAME_CACHE_SIZE 16  /* frames a cache can hold */
+#define FRAME_CACHE_BATCH 8  /* frames moved per refill or drain */
+
+struct frame_cache {
+        struct spinlock fc_lock;
+        unsigned fc_count;                  /* frames in fc_frames */
+        uint32_t fc_frames[FRAME_CACHE_SIZE];
+        unsigned fc_hits;     /* allocations and frees done locally */
+        unsigned fc_refills;  /* batches taken from the buddy allocator */
+        unsigned fc_drains;   /* batches given back to it */
+};
+
+/* one per cpu up to VM_CPUS; the rest go straight to the buddy allocator */
+static struct frame_cache frame_caches[VM_CPUS];
+
+/*
+ * Page out thread. Allocations that leave fewer than pageout_low free
+ * frames wake it, and it pages out until pageout_high frames are free
+ * again, so faults normally find a free frame without waiting for the
+ * disk. User allocations that would take the free frames below
+ * pageout_min wait for it instead; the frames under pageout_min are
+ * kept for the kernel, in particular for paging out itself. The
+ * watermarks scale with the amount of memory.
+ */
+#define PAGEOUT_MIN_SHIFT 6  /* pageout_min is 1/64th of user memory */
+#define PAGEOUT_MIN_FLOOR 4  /* but at least this many frames */
+
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+static struct wchan *pageout_wchan;      /* the thread sleeps here */
+static struct wchan *pageout_waitchan;   /* waiting allocations sleep here */
+static int pageout_running;              /* the thread has started */
+static unsigned pageout_waiters;         /* allocations waiting for a pass */
+static unsigned pageout_passes;          /* passes finished */
+static unsigned pageout_lastpass;        /* frames freed by the last pass */
+static unsigned pageout_min, pageout_low, pageout_high;
+
+/* page out thread statistics, protected by pageout_lock */
+static unsigned pageout_wakeups;   /* passes started */
+static unsigned pageout_reclaimed; /* frames freed by the passes */
+static unsigned pageout_stalls;    /* allocations that waited for a pass */
+static unsigned pageout_failed;    /* passes that freed nothing */
 
 #define PAGE_BITS 12
 #define TRUE 1
@@ -70,6 +199,7 @@ ram_bootstrap(void)
 {
 	size_t ramsize, frametable_size;
         uint32_t npages, i;
+        unsigned order;
 
 	/* Get size of RAM. */
 	ramsize = mainbus_ramsize();
@@ -130,6 +260,10 @@ ram_bootstrap(void)
                 /* Mark as allocated as individual pages */
                 frame_table[i].allocated = TRUE;
                 frame_table[i].not_last = FALSE;
+                frame_table[i].pinned = TRUE;
+                frame_table[i].refcount = 1;
+                frame_table[i].as = NULL;
+                frame_table[i].rmap = NULL;
         }                                            
         
         /* 
@@ -137,12 +271,39 @@ ram_bootstrap(void)
          */
         
         first_frame = firstpaddr >> PAGE_BITS;
+        clock_hand = first_frame;
+
+        for (i = 0; i < VM_CPUS; i++) {
+                spinlock_init(&frame_caches[i].fc_lock);
+                frame_caches[i].fc_count = 0;
+        }
         
         for (i = first_frame; i < (lastpaddr >> PAGE_BITS); i++) {
                 frame_table[i].allocated = FALSE;
+                frame_table[i].pinned = FALSE;
+                frame_table[i].free_head = FALSE;
+                frame_table[i].refcount = 0;
+                frame_table[i].as = NULL;
+                frame_table[i].rmap = NULL;
         }
 
-        
+        /* hand the free frames to the buddy allocator in aligned blocks */
+        for (order = 0; order < BUDDY_ORDERS; order++) {
+                buddy_free_list[order] = BUDDY_NONE;
+                buddy_free_count[order] = 0;
+        }
+
+        i = first_frame;
+        while (i < last_frame) {
+                order = 0;
+                while (order + 1 < BUDDY_ORDERS &&
+                       (i & ((2u << order) - 1)) == 0 &&
+                       i + (2u << order) <= last_frame) {
+                        order++;
+                }
+                buddy_push(i, order);
+                i += 1u << order;
+        }
 }
 
 /*
@@ -189,90 +350,301 @@ ram_getfirstfree(void)
 }
 
 /*
- * This is a relatively inefficient first-fit allocator. Single pages
- * always fit. Multiframe allocations can suffer from external
- * fragmentation. It is intended to be easy to understand and robust,
- * not efficient.
+ * Frames are allocated with a binary buddy allocator, so allocating
+ * and freeing take time logarithmic in the size of memory rather than
+ * linear. A request for n frames takes a block of the next power of
+ * two and gives the unused tail straight back, so multiframe
+ * allocations waste nothing. Freed frames are merged with their free
+ * buddies into ever larger blocks.
+ *
+ * All of these are called with frame_table_spinlock held.
  */
 
+/* Add the free block of 2^order frames at frame i to its free list. */
+static void buddy_push(uint32_t i, unsigned order)
+{
+        frame_table[i].free_head = TRUE;
+        frame_table[i].order = order;
+        frame_table[i].prev_free = BUDDY_NONE;
+        frame_table[i].next_free = buddy_free_list[order];
+        if (buddy_free_list[order] != BUDDY_NONE) {
+                frame_table[buddy_free_list[order]].prev_free = i;
+        }
+        buddy_free_list[order] = i;
+        buddy_free_count[order]++;
+        buddy_frames += 1u << order;
+}
 
-static paddr_t alloc_one_frame(unsigned int npages)
+/* Take the free block at frame i off its free list. */
+static void buddy_unlink(uint32_t i)
 {
-        unsigned int i;
+        unsigned order;
 
-        /* 
-         * Just scan from the start of the frame_table array for an
-         * unallocated block
-         */
-        
-        KASSERT(npages == 1);
+        KASSERT(frame_table[i].free_head == TRUE);
 
-        spinlock_acquire(&frame_table_spinlock);
-        for (i =  first_frame; i < last_frame; i++) {
-                if (frame_table[i].allocated == FALSE) {
-                        frame_table[i].allocated = TRUE;
-                        frame_table[i].not_last = FALSE;
+        order = frame_table[i].order;
+        if (frame_table[i].prev_free != BUDDY_NONE) {
+                frame_table[frame_table[i].prev_free].next_free =
+                        frame_table[i].next_free;
+        }
+        else {
+                buddy_free_list[order] = frame_table[i].next_free;
+        }
+        if (frame_table[i].next_free != BUDDY_NONE) {
+                frame_table[frame_table[i].next_free].prev_free =
+                        frame_table[i].prev_free;
+        }
+        frame_table[i].free_head = FALSE;
+        buddy_free_count[order]--;
+        buddy_frames -= 1u << order;
+}
 
-                        spinlock_release(&frame_table_spinlock);
+/*
+ * Take a free block of 2^order frames, splitting a larger one if
+ * there is none that size. Returns its first frame or BUDDY_NONE.
+ */
+static uint32_t buddy_take(unsigned order)
+{
+        unsigned k;
+        uint32_t i;
 
-                        return (paddr_t) (i << PAGE_BITS);
+        for (k = order; k < BUDDY_ORDERS; k++) {
+                if (buddy_free_list[k] != BUDDY_NONE) {
+                        break;
                 }
         }
-        
-        /* Did not find an unallocated frame :-( */
+        if (k == BUDDY_ORDERS) {
+                return BUDDY_NONE;
+        }
 
-        spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+        i = buddy_free_list[k];
+        buddy_unlink(i);
+
+        /* give back the upper halves until the block is small enough */
+        while (k > order) {
+                k--;
+                buddy_push(i + (1u << k), k);
+        }
+
+        return i;
 }
 
-static paddr_t alloc_multiple_frames(unsigned int npages)
+/*
+ * Give the single frame i back, merging it with its buddy for as long
+ * as the buddy is a whole free block of the same size.
+ */
+static void buddy_free(uint32_t i)
 {
-        unsigned int i,j;
+        unsigned order;
+        uint32_t buddy;
 
+        for (order = 0; order + 1 < BUDDY_ORDERS; order++) {
+                buddy = i ^ (1u << order);
+                if (buddy < first_frame || buddy >= last_frame ||
+                    frame_table[buddy].free_head == FALSE ||
+                    frame_table[buddy].order != order) {
+                        break;
+                }
+                buddy_unlink(buddy);
+                if (buddy < i) {
+                        i = buddy;
+                }
+        }
 
-        /* scan from 'i' for the number of needed free frames. If an
-         * allocated frame is encountered, restart the scan from after
-         * that point.
-         */
-        
+        buddy_push(i, order);
+}
+
+/* Mark frame i allocated, with no owner and a single reference. */
+static void frame_claim(uint32_t i, int not_last)
+{
+        frame_table[i].allocated = TRUE;
+        frame_table[i].not_last = not_last;
+        frame_table[i].pinned = FALSE;
+        frame_table[i].refcount = 1;
+        frame_table[i].as = NULL;
+        frame_table[i].rmap = NULL;
+}
+
+/* Mark frame i free and give it back to the buddy allocator. */
+static void frame_release(uint32_t i)
+{
+        KASSERT(frame_table[i].rmap == NULL);
+        frame_table[i].allocated = FALSE;
+        frame_table[i].not_last = FALSE;
+        frame_table[i].pinned = FALSE;
+        frame_table[i].refcount = 0;
+        frame_table[i].as = NULL;
+        buddy_free(i);
+}
+
+/* The current cpu's frame cache, or NULL if it has none. */
+static struct frame_cache *frame_cache_get(void)
+{
+        if (!CURCPU_EXISTS() || curcpu->c_number >= VM_CPUS) {
+                return NULL;
+        }
+        return &frame_caches[curcpu->c_number];
+}
+
+/*
+ * Move up to FRAME_CACHE_BATCH frames from the buddy allocator into a
+ * cache, claiming them. Called with the cache locked.
+ */
+static void frame_cache_refill(struct frame_cache *fc)
+{
+        uint32_t i;
+        unsigned n;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (n = 0; n < FRAME_CACHE_BATCH; n++) {
+                i = buddy_take(0);
+                if (i == BUDDY_NONE) {
+                        break;
+                }
+                frame_claim(i, FALSE);
+                fc->fc_frames[fc->fc_count++] = i;
+        }
+        spinlock_release(&frame_table_spinlock);
+        fc->fc_refills++;
+}
+
+/*
+ * Give up to COUNT frames of a cache back to the buddy allocator.
+ * Called with the cache locked.
+ */
+static void frame_cache_drain(struct frame_cache *fc, unsigned count)
+{
+        uint32_t i;
 
         spinlock_acquire(&frame_table_spinlock);
+        while (count > 0 && fc->fc_count > 0) {
+                i = fc->fc_frames[--fc->fc_count];
+                frame_table[i].allocated = FALSE;
+                frame_table[i].refcount = 0;
+                buddy_free(i);
+                count--;
+        }
+        spinlock_release(&frame_table_spinlock);
+        fc->fc_drains++;
+}
+
+/*
+ * Empty every cpu's cache into the buddy allocator, when it has run
+ * dry while frames may still sit in other cpus' caches.
+ */
+static void frame_cache_drain_all(void)
+{
+        unsigned i;
+
+        for (i = 0; i < VM_CPUS; i++) {
+                spinlock_acquire(&frame_caches[i].fc_lock);
+                if (frame_caches[i].fc_count > 0) {
+                        frame_cache_drain(&frame_caches[i], FRAME_CACHE_SIZE);
+                }
+                spinlock_release(&frame_caches[i].fc_lock);
+        }
+}
+
+static paddr_t alloc_one_frame(unsigned int npages)
+{
+        struct frame_cache *fc;
+        uint32_t i;
 
-        i = first_frame; j = 0;
+        KASSERT(npages == 1);
 
-        while (i < (last_frame - npages) && j < npages) {
-                if (frame_table[i+j].allocated == TRUE) {
-                        i = i + j + 1; /* continue scan after allocated frame */
-                        j = 0;         /* restart the count */
+        fc = frame_cache_get();
+        if (fc != NULL) {
+                spinlock_acquire(&fc->fc_lock);
+                if (fc->fc_count == 0) {
+                        frame_cache_refill(fc);
                 }
                 else {
-                        j = j + 1; /* increment count of free frames */
+                        fc->fc_hits++;
+                }
+                if (fc->fc_count > 0) {
+                        i = fc->fc_frames[--fc->fc_count];
+                        spinlock_release(&fc->fc_lock);
+                        return (paddr_t) (i << PAGE_BITS);
                 }
+                spinlock_release(&fc->fc_lock);
+
+                /* the last free frames may be in other caches */
+                frame_cache_drain_all();
         }
 
-        if  (j == npages) { /* we exited as we found the number of frames required. */
-                for (j = i; j < i + npages - 1; j++) {
-                        frame_table[j].allocated = TRUE; /* mark frame allocated */
-                        frame_table[j].not_last = TRUE;  /* as a contiguous block */
-                }
-                frame_table[j].allocated = TRUE;
-                frame_table[j].not_last = FALSE;
+        spinlock_acquire(&frame_table_spinlock);
 
+        i = buddy_take(0);
+        if (i == BUDDY_NONE) {
+                /* Did not find an unallocated frame :-( */
                 spinlock_release(&frame_table_spinlock);
-                
-                return (paddr_t) (i << PAGE_BITS);
+                return (paddr_t) 0;
+        }
+        frame_claim(i, FALSE);
+
+        spinlock_release(&frame_table_spinlock);
+
+        return (paddr_t) (i << PAGE_BITS);
+}
+
+static paddr_t alloc_multiple_frames(unsigned int npages)
+{
+        unsigned order, k;
+        uint32_t i, j, end;
+
+        /* smallest block that holds npages */
+        order = 0;
+        while ((1u << order) < npages) {
+                order++;
+        }
+        if (order >= BUDDY_ORDERS) {
+                return (paddr_t) 0;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        i = buddy_take(order);
+        if (i == BUDDY_NONE) {
+                /* no contiguous range of frames that large :-( */
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) 0;
+        }
+
+        for (j = i; j < i + npages; j++) {
+                frame_claim(j, j < i + npages - 1);
+        }
+
+        /*
+         * Return the tail as the largest aligned blocks that fit. Each
+         * one's buddy overlaps the frames just allocated, so none of
+         * them can merge yet.
+         */
+        end = i + (1u << order);
+        while (j < end) {
+                k = 0;
+                while ((j & ((2u << k) - 1)) == 0 && j + (2u << k) <= end) {
+                        k++;
+                }
+                buddy_push(j, k);
+                j += 1u << k;
         }
-        
-        /* Did not find an unallocated contiguous range of frames :-( */
 
         spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+
+        return (paddr_t) (i << PAGE_BITS);
 }
 
-static void free_frames(vaddr_t vaddr)
+/*
+ * Drop a reference to the block at vaddr, freeing it if that was the
+ * last one. Returns the number of frames freed.
+ */
+static unsigned free_frames(vaddr_t vaddr)
 {
+        struct frame_cache *fc;
         paddr_t paddr;
         uint32_t i;
+        unsigned freed;
+        int not_last;
 
         KASSERT(vaddr != (vaddr_t) NULL);
 
@@ -280,42 +652,1074 @@ static void free_frames(vaddr_t vaddr)
 
         i = paddr >> PAGE_BITS;
 
+        /*
+         * A single frame with one reference is ours alone: nobody can
+         * share it meanwhile, so it can go to the local cache. A user
+         * frame still has its owner cleared under the frame table lock
+         * so the clock hand is not looking at the address space when
+         * it goes away.
+         */
+        fc = frame_cache_get();
+        if (fc != NULL && frame_table[i].allocated == TRUE &&
+            frame_table[i].refcount == 1 && frame_table[i].not_last == FALSE) {
+                if (frame_table[i].as != NULL) {
+                        spinlock_acquire(&frame_table_spinlock);
+                        frame_table[i].as = NULL;
+                        frame_table[i].pinned = FALSE;
+                        spinlock_release(&frame_table_spinlock);
+                }
+
+                spinlock_acquire(&fc->fc_lock);
+                if (fc->fc_count == FRAME_CACHE_SIZE) {
+                        frame_cache_drain(fc, FRAME_CACHE_BATCH);
+                }
+                else {
+                        fc->fc_hits++;
+                }
+                fc->fc_frames[fc->fc_count++] = i;
+                spinlock_release(&fc->fc_lock);
+                return 1;
+        }
+
         spinlock_acquire(&frame_table_spinlock);
 
         if (frame_table[i].allocated == FALSE) { /* check for double free error */
                 panic("Double free error!!");
         }
-        
-        while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
-                frame_table[i].allocated = FALSE;
-                if (frame_table[i].not_last == TRUE) {
-                        i++;
+
+        /* a shared frame is only released by its last user */
+        if (frame_table[i].refcount > 1) {
+                KASSERT(frame_table[i].not_last == FALSE);
+                frame_table[i].refcount--;
+                spinlock_release(&frame_table_spinlock);
+                return 0;
+        }
+
+        freed = 0;
+        do { /* otherwise give back each frame of the block */
+                not_last = frame_table[i].not_last;
+                frame_release(i);
+                i++;
+                freed++;
+        } while (not_last);
+
+        spinlock_release(&frame_table_spinlock);
+
+        return freed;
+}
+
+/*
+ * Advance the clock hand by one frame, counting full sweeps.
+ */
+static uint32_t clock_advance(void)
+{
+        uint32_t i;
+
+        i = clock_hand;
+        clock_hand++;
+        if (clock_hand == last_frame) {
+                clock_hand = first_frame;
+                clock_sweeps++;
+        }
+        clock_scanned++;
+
+        return i;
+}
+
+/*
+ * A frame being paged out by evict_select(), until evict_finish().
+ */
+struct victim {
+        uint32_t v_frame;        /* frame number */
+        struct addrspace *v_as;  /* owner */
+        vaddr_t v_vaddr;         /* where the owner maps it */
+        paddr_t v_pte;           /* page table entry before the page out */
+};
+
+/*
+ * Choose a frame to page out and start paging it out.
+ *
+ * Victims are chosen with the clock (second chance) algorithm. There
+ * is no hardware reference bit; the software one lives in the owner's
+ * page table entry. When the hand passes a referenced page its bit is
+ * cleared and its TLB entry thrown away, so the next access faults and
+ * vm_fault() sets the bit again. Kernel frames, shared frames and
+ * pinned frames are never evicted.
+ *
+ * The owner's page table entry is checked and marked as paging out
+ * while frame_table_spinlock is held, so the owning address space
+ * cannot free the frame or go away underneath us. The frame is left
+ * pinned and dropped from every TLB. Returns 0 if there is nothing we
+ * can evict.
+ */
+static int evict_select(struct victim *v)
+{
+        struct addrspace *as;
+        vaddr_t vaddr;
+        paddr_t paddr, pte;
+        uint32_t i, n;
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        /* two sweeps: one to clear reference bits, one to find them clear */
+        for (n = 0; n < 2 * (last_frame - first_frame); n++) {
+                i = clock_advance();
+
+                if (frame_table[i].allocated == FALSE ||
+                    frame_table[i].pinned == TRUE ||
+                    frame_table[i].as == NULL ||
+                    frame_table[i].refcount != 1) {
+                        continue;
+                }
+
+                as = frame_table[i].as;
+                vaddr = frame_table[i].vaddr;
+                paddr = (paddr_t) (i << PAGE_BITS);
+
+                if (vm_pageref(as, vaddr, paddr)) {
+                        continue; /* second chance */
+                }
+
+                if (vm_pageout_begin(as, vaddr, paddr, &pte) != 0) {
+                        continue; /* mapping is changing, try another */
                 }
+                frame_table[i].pinned = TRUE;
+                clock_reclaimed++;
+
+                spinlock_release(&frame_table_spinlock);
+
+                /* other CPUs must stop using the frame before it is copied */
+                vm_pageout_shootdown(as, vaddr);
+
+                v->v_frame = i;
+                v->v_as = as;
+                v->v_vaddr = vaddr;
+                v->v_pte = pte;
+                return 1;
         }
+
+        /* Nothing we can evict :-( */
+
         spinlock_release(&frame_table_spinlock);
+        return 0;
 }
-        
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t
-alloc_kpages(unsigned npages)
+
+/*
+ * Finish paging out a victim. Its page table entry becomes PTE: 0 for
+ * a page that can be recreated from scratch, its swap slot if it was
+ * written out, or the old entry if the page out failed and the page
+ * stays where it was. Unless it stays, the frame is now the caller's,
+ * still allocated.
+ */
+static void evict_finish(struct victim *v, paddr_t pte)
 {
-        paddr_t paddr;
-        if (npages > 1 ) {
-                paddr = alloc_multiple_frames(npages);
+        vm_pageout_end(v->v_as, v->v_vaddr, pte);
+
+        spinlock_acquire(&frame_table_spinlock);
+        frame_table[v->v_frame].pinned = FALSE;
+        if (pte != v->v_pte) {
+                frame_table[v->v_frame].as = NULL;
+        }
+        spinlock_release(&frame_table_spinlock);
+}
+
+/* The page table entry of a victim written out to SLOT. */
+static paddr_t evict_swapped(struct victim *v, unsigned slot)
+{
+        return SWAP_SLOT_TO_PTE(slot) | PTE_SWAPPED |
+                (v->v_pte & (TLBLO_DIRTY | PTE_COW));
+}
+
+/*
+ * Page out a user frame and hand it to the caller, still allocated.
+ * Pages that were never modified are simply dropped, to be zero-filled
+ * or read from their file again; dirty ones are written to swap.
+ */
+static paddr_t evict_frame(void)
+{
+        struct victim v;
+        unsigned slot;
+        int result;
+
+        if (!evict_select(&v)) {
+                return (paddr_t) 0;
+        }
+
+        if ((v.v_pte & PTE_MODIFIED) == 0) {
+                /* clean, can be recreated from scratch */
+                evict_finish(&v, 0);
         }
         else {
-                paddr = alloc_one_frame(npages);
+                result = swap_out(PADDR_TO_KVADDR(v.v_frame << PAGE_BITS),
+                                  &slot);
+                if (result) {
+                        /* no swap space, leave the page where it was */
+                        evict_finish(&v, v.v_pte);
+                        return (paddr_t) 0;
+                }
+
+                evict_finish(&v, evict_swapped(&v, slot));
+                vmstat_inc(VMSTAT_SWAPOUTS);
         }
-        
-	if (paddr == 0) {
-		return 0;
-	}
-	return PADDR_TO_KVADDR(paddr);
+
+        return (paddr_t) (v.v_frame << PAGE_BITS);
 }
 
-void
-free_kpages(vaddr_t addr)
+/*
+ * Take a frame from the zero pool, or return 0 if it is empty. The
+ * frame is still allocated with a single reference.
+ */
+static paddr_t zero_pool_take(int count_hit)
 {
-        free_frames(addr);
+        paddr_t paddr;
+
+        spinlock_acquire(&frame_table_spinlock);
+        paddr = 0;
+        if (zero_pool_count > 0) {
+                paddr = zero_pool[--zero_pool_count];
+                if (count_hit) {
+                        zero_pool_hits++;
+                }
+        }
+        else if (count_hit) {
+                zero_pool_misses++;
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        return paddr;
 }
 
+/*
+ * Zero one free frame and add it to the zero pool. Nothing is paged
+ * out for the pool.
+ */
+static void zero_pool_fill(void)
+{
+        paddr_t paddr;
+        int full;
+
+        paddr = alloc_one_frame(1);
+        if (paddr == 0) {
+                return;
+        }
+
+        bzero((void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+        /* another cpu may have filled the pool meanwhile */
+        spinlock_acquire(&frame_table_spinlock);
+        full = zero_pool_count == ZERO_POOL_SIZE;
+        if (!full) {
+                zero_pool[zero_pool_count++] = paddr;
+        }
+        spinlock_release(&frame_table_spinlock);
+        if (full) {
+                free_frames(PADDR_TO_KVADDR(paddr));
+        }
+}
+
+/*
+ * Number of free frames, counting the frame caches and the zero pool.
+ * Read without locks, so only good as an estimate.
+ */
+static unsigned frames_free(void)
+{
+        unsigned count, i;
+
+        count = buddy_frames + zero_pool_count;
+        for (i = 0; i < VM_CPUS; i++) {
+                count += frame_caches[i].fc_count;
+        }
+
+        return count;
+}
+
+/*
+ * Wake the page out thread if free memory has dropped below the low
+ * watermark. Called after allocating.
+ */
+static void pageout_check(void)
+{
+        if (!pageout_running || frames_free() >= pageout_low) {
+                return;
+        }
+
+        spinlock_acquire(&pageout_lock);
+        wchan_wakeone(pageout_wchan, &pageout_lock);
+        spinlock_release(&pageout_lock);
+}
+
+/*
+ * Wait for the page out thread to finish a pass. Returns the number
+ * of frames it freed, so 0 if there is nothing left to page out or
+ * the thread is not running yet.
+ */
+static unsigned pageout_wait(void)
+{
+        unsigned pass, freed;
+
+        if (!pageout_running) {
+                return 0;
+        }
+
+        spinlock_acquire(&pageout_lock);
+        pageout_stalls++;
+        pageout_waiters++;
+        pass = pageout_passes;
+        wchan_wakeone(pageout_wchan, &pageout_lock);
+        while (pageout_passes == pass) {
+                wchan_sleep(pageout_waitchan, &pageout_lock);
+        }
+        pageout_waiters--;
+        freed = pageout_lastpass;
+        spinlock_release(&pageout_lock);
+
+        return freed;
+}
+
+/*
+ * Called from the idle loop, at splhigh, to have the zeroing thread
+ * add a frame to the zero pool. Only wakes it while the pool has room
+ * and there are free frames beyond the low watermark to spare, so an
+ * idle CPU with nothing to zero still goes idle. Returns whether the
+ * thread was woken.
+ */
+int
+zero_pool_wake(void)
+{
+        int woken;
+
+        /* unlocked estimates; a wakeup too many or too few is harmless */
+        if (!zero_pool_running || zero_pool_count == ZERO_POOL_SIZE ||
+            frames_free() <= zero_pool_count + pageout_low) {
+                return FALSE;
+        }
+
+        spinlock_acquire(&zero_pool_lock);
+        woken = zero_pool_sleeping;
+        if (woken) {
+                zero_pool_sleeping = FALSE;
+                wchan_wakeone(zero_pool_wchan, &zero_pool_lock);
+        }
+        spinlock_release(&zero_pool_lock);
+
+        return woken;
+}
+
+static void zero_pool_thread(void *data1, unsigned long data2)
+{
+        (void) data1;
+        (void) data2;
+
+        spinlock_acquire(&zero_pool_lock);
+        while (1) {
+                zero_pool_sleeping = TRUE;
+                wchan_sleep(zero_pool_wchan, &zero_pool_lock);
+                spinlock_release(&zero_pool_lock);
+
+                zero_pool_fill();
+
+                spinlock_acquire(&zero_pool_lock);
+        }
+}
+
+/* Whether victim a sorts before b, by address space and address. */
+static int victim_before(const struct victim *a, const struct victim *b)
+{
+        if (a->v_as != b->v_as) {
+                return (vaddr_t) a->v_as < (vaddr_t) b->v_as;
+        }
+        return a->v_vaddr < b->v_vaddr;
+}
+
+/*
+ * Page out up to swap_cluster frames for the page out thread. Clean
+ * pages are dropped straight away. The dirty ones are sorted by
+ * address space and address, so virtually adjacent pages land in
+ * adjacent slots where swap-in can read them ahead, and are written
+ * to swap together. Returns the number of frames freed.
+ */
+static unsigned pageout_cluster(void)
+{
+        struct victim v[SWAP_CLUSTER_MAX], tmp;
+        vaddr_t kvaddrs[SWAP_CLUSTER_MAX];
+        unsigned slots[SWAP_CLUSTER_MAX];
+        unsigned max, n, k, j, freed;
+        int result;
+
+        max = swap_cluster;
+        if (max == 0 || max > SWAP_CLUSTER_MAX) {
+                max = SWAP_CLUSTER_MAX;
+        }
+
+        n = 0;
+        freed = 0;
+        while (n < max && frames_free() + n < pageout_high) {
+                if (!evict_select(&v[n])) {
+                        break;
+                }
+                if ((v[n].v_pte & PTE_MODIFIED) == 0) {
+                        /* clean, can be recreated from scratch */
+                        evict_finish(&v[n], 0);
+                        free_kpages(PADDR_TO_KVADDR(v[n].v_frame << PAGE_BITS));
+                        freed++;
+                        continue;
+                }
+                n++;
+        }
+        if (n == 0) {
+                return freed;
+        }
+
+        for (k = 1; k < n; k++) {
+                tmp = v[k];
+                for (j = k; j > 0 && victim_before(&tmp, &v[j - 1]); j--) {
+                        v[j] = v[j - 1];
+                }
+                v[j] = tmp;
+        }
+
+        for (k = 0; k < n; k++) {
+                kvaddrs[k] = PADDR_TO_KVADDR(v[k].v_frame << PAGE_BITS);
+        }
+        result = swap_out_cluster(kvaddrs, n, slots);
+
+        for (k = 0; k < n; k++) {
+                if (result) {
+                        /* no swap space, leave the pages where they were */
+                        evict_finish(&v[k], v[k].v_pte);
+                        continue;
+                }
+                evict_finish(&v[k], evict_swapped(&v[k], slots[k]));
+                vmstat_inc(VMSTAT_SWAPOUTS);
+                free_kpages(kvaddrs[k]);
+                freed++;
+        }
+
+        return freed;
+}
+
+/*
+ * One pass of the page out thread: page out frames, and give up
+ * cached text no process maps, until pageout_high frames are free.
+ * Returns the number of frames freed.
+ */
+static unsigned pageout_reclaim(void)
+{
+        unsigned freed, n;
+
+        freed = 0;
+        while (frames_free() < pageout_high) {
+                n = pageout_cluster();
+                if (n != 0) {
+                        freed += n;
+                        continue;
+                }
+
+                n = textcache_shrink();
+                if (n == 0) {
+                        break; /* nothing left to take */
+                }
+                freed += n;
+        }
+
+        return freed;
+}
+
+static void pageout_thread(void *data1, unsigned long data2)
+{
+        unsigned freed;
+
+        (void) data1;
+        (void) data2;
+
+        spinlock_acquire(&pageout_lock);
+        while (1) {
+                while (pageout_waiters == 0 && frames_free() >= pageout_low) {
+                        wchan_sleep(pageout_wchan, &pageout_lock);
+                }
+                pageout_wakeups++;
+                spinlock_release(&pageout_lock);
+
+                freed = pageout_reclaim();
+
+                spinlock_acquire(&pageout_lock);
+                pageout_passes++;
+                pageout_lastpass = freed;
+                pageout_reclaimed += freed;
+                if (freed == 0) {
+                        pageout_failed++;
+                }
+                wchan_wakeall(pageout_waitchan, &pageout_lock);
+        }
+}
+
+/*
+ * Set the watermarks and start the page out and zeroing threads.
+ * Called once the rest of the VM system is up.
+ */
+void
+pageout_bootstrap(void)
+{
+        int result;
+
+        pageout_min = (last_frame - first_frame) >> PAGEOUT_MIN_SHIFT;
+        if (pageout_min < PAGEOUT_MIN_FLOOR) {
+                pageout_min = PAGEOUT_MIN_FLOOR;
+        }
+        pageout_low = 2 * pageout_min;
+        pageout_high = 3 * pageout_min;
+
+        pageout_wchan = wchan_create("pageout");
+        pageout_waitchan = wchan_create("pageout wait");
+        if (pageout_wchan == NULL || pageout_waitchan == NULL) {
+                panic("vm: no memory for the page out thread\n");
+        }
+
+        result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+        if (result) {
+                panic("vm: cannot start the page out thread: %s\n",
+                      strerror(result));
+        }
+        pageout_running = 1;
+
+        zero_pool_wchan = wchan_create("zero pool");
+        if (zero_pool_wchan == NULL) {
+                panic("vm: no memory for the zeroing thread\n");
+        }
+
+        result = thread_fork("zero pool", NULL, zero_pool_thread, NULL, 0);
+        if (result) {
+                panic("vm: cannot start the zeroing thread: %s\n",
+                      strerror(result));
+        }
+        zero_pool_running = 1;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+        paddr_t paddr;
+        if (npages > 1 ) {
+                paddr = alloc_multiple_frames(npages);
+        }
+        else {
+                paddr = alloc_one_frame(npages);
+                if (paddr == 0) {
+                        paddr = zero_pool_take(FALSE);
+                }
+        }
+
+        /*
+         * Eviction sleeps on disk I/O, so only make room for a
+         * single page if the caller is allowed to sleep.
+         */
+        if (paddr == 0 && npages == 1 && curthread != NULL &&
+            !curthread->t_in_interrupt && curthread->t_iplhigh_count == 0) {
+                paddr = evict_frame();
+        }
+        
+	if (paddr == 0) {
+		return 0;
+	}
+        vmstat_add(VMSTAT_FRAMES_ALLOC, npages);
+        pageout_check();
+	return PADDR_TO_KVADDR(paddr);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+        vmstat_add(VMSTAT_FRAMES_FREED, free_frames(addr));
+}
+
+/*
+ * Drop a reference to the single frame i, releasing it if that was the
+ * last one. Returns the number of frames freed. Called with the frame
+ * table lock held.
+ */
+static unsigned frame_unref(uint32_t i)
+{
+        if (frame_table[i].allocated == FALSE) {
+                panic("Double free error!!");
+        }
+        KASSERT(frame_table[i].not_last == FALSE);
+
+        if (frame_table[i].refcount > 1) {
+                frame_table[i].refcount--;
+                return 0;
+        }
+        frame_release(i);
+        return 1;
+}
+
+/*
+ * Free a batch of single frames, e.g. the pages of an address space
+ * that is going away, taking the frame table lock once for the lot.
+ * Shared frames just lose a reference, as in free_kpages().
+ */
+void
+free_kpages_batch(const vaddr_t *addrs, unsigned count)
+{
+        unsigned k, freed;
+
+        freed = 0;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (k = 0; k < count; k++) {
+                freed += frame_unref(KVADDR_TO_PADDR(addrs[k]) >> PAGE_BITS);
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        vmstat_add(VMSTAT_FRAMES_FREED, freed);
+}
+
+/*
+ * Copy-on-write support. A single frame may be mapped by several
+ * address spaces after fork(); each mapping holds a reference and
+ * free_kpages() only releases the frame when the last one goes away.
+ * Frames with more than one reference are never evicted.
+ *
+ * share_kpages() adds a reference that is not a mapping, or a mapping
+ * the reverse map does not record; share_upage() below adds a mapping.
+ */
+int
+share_kpages(vaddr_t addr)
+{
+        uint32_t i;
+
+        i = KVADDR_TO_PADDR(addr) >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        /* the frame is being paged out or filled, try again later */
+        if (frame_table[i].allocated == FALSE ||
+            frame_table[i].pinned == TRUE) {
+                spinlock_release(&frame_table_spinlock);
+                return EBUSY;
+        }
+
+        KASSERT(frame_table[i].not_last == FALSE);
+        frame_table[i].refcount++;
+
+        spinlock_release(&frame_table_spinlock);
+
+        return 0;
+}
+
+unsigned
+kpages_refcount(vaddr_t addr)
+{
+        uint32_t i;
+        unsigned refcount;
+
+        i = KVADDR_TO_PADDR(addr) >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+        refcount = frame_table[i].refcount;
+        spinlock_release(&frame_table_spinlock);
+
+        return refcount;
+}
+
+/*
+ * Hand out the frame at PADDR, just allocated, for the user page at
+ * VADDR in AS: it is pinned, with AS as its owner.
+ */
+static vaddr_t upage_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i;
+
+        i = paddr >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+        frame_table[i].pinned = TRUE;
+        frame_table[i].as = as;
+        frame_table[i].vaddr = vaddr & PAGE_FRAME;
+        spinlock_release(&frame_table_spinlock);
+
+        vmstat_inc(VMSTAT_FRAMES_ALLOC);
+        return PADDR_TO_KVADDR(paddr);
+}
+
+/*
+ * Allocate a frame for the user page at VADDR in AS. Free frames are
+ * taken down to pageout_min; below that the page out thread is asked
+ * to make room and the allocation waits for it. Only if it finds
+ * nothing to page out is the reserve used.
+ *
+ * The frame comes back pinned so that it is not evicted while it is
+ * being filled; unpin_upage() it once its page table entry is set.
+ */
+vaddr_t
+alloc_upage(struct addrspace *as, vaddr_t vaddr)
+{
+        paddr_t paddr;
+
+        paddr = 0;
+        while (paddr == 0) {
+                if (frames_free() > pageout_min) {
+                        paddr = alloc_one_frame(1);
+                        if (paddr == 0) {
+                                paddr = zero_pool_take(FALSE);
+                        }
+                        if (paddr != 0) {
+                                break;
+                        }
+                }
+
+                if (pageout_wait() == 0) {
+                        /* nothing could be paged out, dip into the reserve */
+                        paddr = alloc_one_frame(1);
+                        if (paddr == 0) {
+                                paddr = zero_pool_take(FALSE);
+                        }
+                        if (paddr == 0) {
+                                paddr = evict_frame();
+                        }
+                        if (paddr == 0) {
+                                return 0;
+                        }
+                }
+        }
+        pageout_check();
+
+        return upage_claim(paddr, as, vaddr);
+}
+
+/*
+ * Like alloc_upage(), but the frame comes back zero-filled. Frames
+ * from the zero pool are already zeroed; otherwise the caller pays
+ * for zeroing one.
+ */
+vaddr_t
+alloc_zeroed_upage(struct addrspace *as, vaddr_t vaddr)
+{
+        paddr_t paddr;
+        vaddr_t kvaddr;
+
+        paddr = 0;
+        if (frames_free() > pageout_min) {
+                paddr = zero_pool_take(TRUE);
+        }
+        if (paddr == 0) {
+                kvaddr = alloc_upage(as, vaddr);
+                if (kvaddr != 0) {
+                        bzero((void *) kvaddr, PAGE_SIZE);
+                }
+                return kvaddr;
+        }
+
+        pageout_check();
+
+        return upage_claim(paddr, as, vaddr);
+}
+
+/*
+ * Like alloc_upage(), for a page that is only wanted if memory is
+ * plentiful, e.g. one read ahead. Only free frames above the low
+ * watermark are used: nothing is paged out and there is no waiting.
+ */
+vaddr_t
+alloc_upage_ahead(struct addrspace *as, vaddr_t vaddr)
+{
+        paddr_t paddr;
+
+        if (frames_free() <= pageout_low) {
+                return 0;
+        }
+
+        paddr = alloc_one_frame(1);
+        if (paddr == 0) {
+                return 0;
+        }
+
+        return upage_claim(paddr, as, vaddr);
+}
+
+void
+unpin_upage(vaddr_t addr)
+{
+        uint32_t i;
+
+        i = KVADDR_TO_PADDR(addr) >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        frame_table[i].pinned = FALSE;
+        spinlock_release(&frame_table_spinlock);
+}
+
+void
+rmap_bootstrap(void)
+{
+        rmap_cache = ptcache_create("rmap", sizeof(struct rmap));
+        if (rmap_cache == NULL) {
+                panic("vm: no memory for the reverse map\n");
+        }
+}
+
+/*
+ * Forget the mapping of frame I at VADDR in AS. When the mapping kept
+ * in the frame table entry goes, the next one on the list moves up,
+ * so a frame that is private again is evictable by its last mapper.
+ * Returns the rmap entry that is no longer used, if any, to be freed
+ * once the frame table lock is dropped. Mappings that were never
+ * recorded are ignored. Called with the frame table lock held.
+ */
+static struct rmap *rmap_remove(uint32_t i, struct addrspace *as,
+                                vaddr_t vaddr)
+{
+        struct rmap **prev, *rm;
+
+        vaddr &= PAGE_FRAME;
+
+        if (frame_table[i].as == as && frame_table[i].vaddr == vaddr) {
+                rm = frame_table[i].rmap;
+                if (rm == NULL) {
+                        frame_table[i].as = NULL;
+                        return NULL;
+                }
+                frame_table[i].as = rm->rm_as;
+                frame_table[i].vaddr = rm->rm_vaddr;
+                frame_table[i].rmap = rm->rm_next;
+                return rm;
+        }
+
+        for (prev = &frame_table[i].rmap; *prev != NULL;
+             prev = &(*prev)->rm_next) {
+                rm = *prev;
+                if (rm->rm_as == as && rm->rm_vaddr == vaddr) {
+                        *prev = rm->rm_next;
+                        return rm;
+                }
+        }
+
+        return NULL;
+}
+
+/*
+ * Map the user frame at ADDR at VADDR in AS as well, adding a
+ * reference. Fails with EBUSY, like share_kpages(), if the frame is
+ * being paged out, or ENOMEM if there is no memory to record the
+ * mapping.
+ */
+int
+share_upage(vaddr_t addr, struct addrspace *as, vaddr_t vaddr)
+{
+        struct rmap *rm;
+        uint32_t i;
+
+        i = KVADDR_TO_PADDR(addr) >> PAGE_BITS;
+
+        /* allocated up front, it may page something out */
+        rm = ptcache_alloc(rmap_cache);
+        if (rm == NULL) {
+                return ENOMEM;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        if (frame_table[i].allocated == FALSE ||
+            frame_table[i].pinned == TRUE) {
+                spinlock_release(&frame_table_spinlock);
+                ptcache_free(rmap_cache, rm);
+                return EBUSY;
+        }
+
+        KASSERT(frame_table[i].not_last == FALSE);
+        frame_table[i].refcount++;
+
+        if (frame_table[i].as == NULL) {
+                frame_table[i].as = as;
+                frame_table[i].vaddr = vaddr & PAGE_FRAME;
+        }
+        else {
+                rm->rm_as = as;
+                rm->rm_vaddr = vaddr & PAGE_FRAME;
+                rm->rm_next = frame_table[i].rmap;
+                frame_table[i].rmap = rm;
+                rm = NULL;
+        }
+
+        spinlock_release(&frame_table_spinlock);
+
+        if (rm != NULL) {
+                ptcache_free(rmap_cache, rm);
+        }
+
+        return 0;
+}
+
+/*
+ * Unmap the user frame at ADDR from VADDR in AS and drop the mapping's
+ * reference, freeing the frame if it was the last.
+ */
+void
+free_upage(vaddr_t addr, struct addrspace *as, vaddr_t vaddr)
+{
+        struct rmap *rm;
+        uint32_t i;
+
+        i = KVADDR_TO_PADDR(addr) >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+        rm = rmap_remove(i, as, vaddr);
+        spinlock_release(&frame_table_spinlock);
+
+        if (rm != NULL) {
+                ptcache_free(rmap_cache, rm);
+        }
+
+        free_kpages(addr);
+}
+
+/*
+ * Like free_upage() for a batch of frames of AS, ADDRS[k] being mapped
+ * at VADDRS[k], taking the frame table lock once for the lot.
+ */
+void
+free_upages_batch(struct addrspace *as, const vaddr_t *addrs,
+                  const vaddr_t *vaddrs, unsigned count)
+{
+        struct rmap *unused, *rm;
+        uint32_t i;
+        unsigned k, freed;
+
+        unused = NULL;
+        freed = 0;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (k = 0; k < count; k++) {
+                i = KVADDR_TO_PADDR(addrs[k]) >> PAGE_BITS;
+
+                rm = rmap_remove(i, as, vaddrs[k]);
+                if (rm != NULL) {
+                        rm->rm_next = unused;
+                        unused = rm;
+                }
+                freed += frame_unref(i);
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        while (unused != NULL) {
+                rm = unused;
+                unused = rm->rm_next;
+                ptcache_free(rmap_cache, rm);
+        }
+
+        vmstat_add(VMSTAT_FRAMES_FREED, freed);
+}
+
+/*
+ * Print the state of a frame and every mapping of it, for the rmap
+ * menu command.
+ */
+void
+rmap_printframe(uint32_t frame)
+{
+        struct rmap *rm;
+
+        if (frame < first_frame || frame >= last_frame) {
+                kprintf("rmap: frame %u is not a user frame (%u-%u)\n",
+                        frame, first_frame, last_frame - 1);
+                return;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        kprintf("frame %u (paddr 0x%x): %s, %u references%s\n", frame,
+                frame << PAGE_BITS,
+                frame_table[frame].allocated ? "allocated" : "free",
+                frame_table[frame].refcount,
+                frame_table[frame].pinned ? ", pinned" : "");
+
+        if (frame_table[frame].allocated && frame_table[frame].as != NULL) {
+                kprintf("    as %p vaddr 0x%x\n", frame_table[frame].as,
+                        frame_table[frame].vaddr);
+                for (rm = frame_table[frame].rmap; rm != NULL;
+                     rm = rm->rm_next) {
+                        kprintf("    as %p vaddr 0x%x\n", rm->rm_as,
+                                rm->rm_vaddr);
+                }
+        }
+
+        spinlock_release(&frame_table_spinlock);
+}
+
+void
+clock_printstats(void)
+{
+        unsigned sweeps, scanned, reclaimed;
+
+        spinlock_acquire(&frame_table_spinlock);
+        sweeps = clock_sweeps;
+        scanned = clock_scanned;
+        reclaimed = clock_reclaimed;
+        spinlock_release(&frame_table_spinlock);
+
+        kprintf("clock: %u sweeps, %u frames scanned, %u frames reclaimed\n",
+                sweeps, scanned, reclaimed);
+}
+
+void
+pageout_printstats(void)
+{
+        spinlock_acquire(&pageout_lock);
+        kprintf("pageout: %u free, watermarks min %u low %u high %u\n",
+                frames_free(), pageout_min, pageout_low, pageout_high);
+        kprintf("pageout: %u passes, %u frames freed, %u passes freed "
+                "nothing, %u allocations waited\n", pageout_wakeups,
+                pageout_reclaimed, pageout_failed, pageout_stalls);
+        spinlock_release(&pageout_lock);
+}
+
+void
+zero_pool_printstats(void)
+{
+        unsigned count, hits, misses;
+
+        spinlock_acquire(&frame_table_spinlock);
+        count = zero_pool_count;
+        hits = zero_pool_hits;
+        misses = zero_pool_misses;
+        spinlock_release(&frame_table_spinlock);
+
+        kprintf("zero pool: %u/%u frames ready, %u hits, %u misses\n",
+                count, ZERO_POOL_SIZE, hits, misses);
+}
+
+void
+buddy_printstats(void)
+{
+        unsigned counts[BUDDY_ORDERS];
+        unsigned order, frames, i;
+        struct frame_cache *fc;
+
+        for (i = 0; i < VM_CPUS; i++) {
+                fc = &frame_caches[i];
+                spinlock_acquire(&fc->fc_lock);
+                if (fc->fc_hits > 0 || fc->fc_refills > 0) {
+                        kprintf("cpu%u frame cache: %u frames, %u local, "
+                                "%u refills, %u drains\n", i, fc->fc_count,
+                                fc->fc_hits, fc->fc_refills, fc->fc_drains);
+                }
+                spinlock_release(&fc->fc_lock);
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (order = 0; order < BUDDY_ORDERS; order++) {
+                counts[order] = buddy_free_count[order];
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        frames = 0;
+        for (order = 0; order < BUDDY_ORDERS; order++) {
+                if (counts[order] > 0) {
+                        kprintf("order %2u (%6u frames): %u free blocks\n",
+                                order, 1u << order, counts[order]);
+                }
+                frames += counts[order] << order;
+        }
+        kprintf("buddy: %u free frames\n", frames);
+}
@@ -36,14 +36,20 @@
 
 
 #include <vm.h>
+#include <array.h>
+#include <spinlock.h>
 #include "opt-dumbvm.h"
+#include "opt-hpt.h"
 
 struct vnode;
+struct wchan;
+struct textfile;
 
 /**
- * Linked list implementation.
+ * Sorted array implementation.
  * 
- * Regions exist within the address space.
+ * Regions exist within the address space. They never overlap and are kept
+ * sorted by address so search_region() can binary search them.
  * 
  * Look at as_define_region() as to what fields struct region should have.
  * 
@@ -51,15 +57,39 @@ struct vnode;
  * calls as_define_region().
  * 
  * We also only care about the virtual address since we have a page table.
+ *
+ * Regions loaded from an executable remember their backing vnode so pages are
+ * read in on first touch by vm_fault(). Bytes of the region past file_size
+ * are zero-filled (BSS).
+ *
+ * Regions created by mmap() are backed by a vnode the same way, and are
+ * marked mapped: their modified pages are written back to the file on
+ * munmap(), fsync() and when the address space goes away.
+ *
+ * Once loading is complete, a read-only segment of an executable also refers
+ * to the shared text cache (see textcache.h), so every process running the
+ * executable maps the same frames for it.
  */
 struct region {
     vaddr_t vaddr;       // Virtual address where region starts.
     size_t memsize;      // Size of region.
     int cur_perm;        // Current region permissions.
     int old_perm;        // Old region permissions.
-    struct region *next; // Next region pointer.
+    struct vnode *vn;    // Backing file, NULL for anonymous memory.
+    off_t file_offset;   // File offset of the data at file_vaddr.
+    vaddr_t file_vaddr;  // Virtual address the file data starts at.
+    size_t file_size;    // Number of bytes backed by the file.
+    int mapped;          // Created by mmap(), written back to the file.
+    struct textfile *text; // Shared frames of a read-only segment, or NULL.
 };
 
+#ifndef ADDRSPACEINLINE
+#define ADDRSPACEINLINE INLINE
+#endif
+
+DECLARRAY(region, ADDRSPACEINLINE);
+DEFARRAY(region, ADDRSPACEINLINE);
+
 
 /**
  * Address space - data structure associated with the virtual memory
@@ -74,7 +104,10 @@ struct region {
  * 
  * A 3 level page table has the following definition:
  * 
- *      paddr_t ***pgtable;
+ *      struct pgnode **pgtable;
+ *
+ * where each 1st level node (see vm.h) holds the 2nd level tables of page
+ * table entries together with counts of their live entries.
  * 
  * To clarify paddr_t is a 32-bit number where:
  *      0xfffff000 is the physical frame number
@@ -85,7 +118,36 @@ struct region {
  * The index of the page table is a 20-bit virtual page number where the virtual
  * to physical address mapping is:
  *      vaddr_t vaddr = faultaddress & TLBHI_VPAGE;
- *      paddr = pgtable[vaddr bits 19 to 11][vaddr bits 11 to 5][vaddr bits 5 to 0]
+ *      paddr = pgtable[vaddr bits 19 to 11]->pn_table[vaddr bits 11 to 5][vaddr bits 5 to 0]
+ *
+ * With "options hpt" there is no per-process page table; entries of the same
+ * format live in the global hashed page table instead (see hpt.h).
+ *
+ * The low bits of an entry hold software flags (see vm.h). A page that has
+ * been paged out keeps its swap slot in the frame number bits.
+ *
+ * Page table entries can be changed by the frame allocator paging out a frame
+ * on behalf of another process, so entries are only read and written with
+ * as_lock held. Anyone finding an entry marked PTE_PAGING sleeps on as_wchan
+ * until the page out is done.
+ *
+ * TLB entries are tagged with the address space's ASID, so they are not
+ * flushed on a context switch. Each CPU hands out its own ASIDs in
+ * generations, so an address space has a separate one on every CPU it has
+ * run on; an ASID from an older generation is stale and a new one is assigned
+ * on activation. as_cpus records, under as_lock, which CPUs have activated
+ * the address space and may still hold its entries, so that a shootdown only
+ * interrupts those. A CPU's bit is cleared again at the next shootdown once
+ * its ASID there has been retired and something else runs on it.
+ *
+ * The heap is an ordinary anonymous region placed after the last ELF segment
+ * when the executable is loaded. It covers the whole pages up to the break,
+ * as_heapend, which sbrk moves one byte at a time.
+ *
+ * The stack is another anonymous region, at the top of user space. A fault
+ * within USERSTACKREACH below it, and within USERSTACKMAX of the top, moves
+ * its base down to cover the faulting page, as long as that leaves
+ * USERSTACKGUARD bytes free above the region below.
  */
 struct addrspace {
 #if OPT_DUMBVM
@@ -97,8 +159,19 @@ struct addrspace {
     size_t as_npages2;
     paddr_t as_stackpbase;
 #else
-    struct region *regions;
-    paddr_t ***pgtable; // Mapping of a vaddr to a paddr.
+    struct regionarray regions;   // Regions sorted by address.
+    struct region *as_lastregion; // Last region found by search_region().
+    struct region *as_heap;       // Heap region, NULL until loaded.
+    vaddr_t as_heapend;           // Current break, the end of the heap.
+    struct region *as_stack;      // Stack region, NULL until defined.
+#if !OPT_HPT
+    struct pgnode **pgtable;      // Mapping of a vaddr to a paddr.
+    unsigned as_pgnodes;          // 1st level page table nodes allocated.
+#endif
+    struct spinlock as_lock;      // Protects page table entries.
+    struct wchan *as_wchan;       // Waiting for a page out to finish.
+    uint32_t as_context[VM_CPUS]; // ASID and its generation on each CPU.
+    uint32_t as_cpus;             // CPUs whose TLB may hold entries.
 #endif
 };
 
@@ -110,7 +183,7 @@ struct region *init_region(vaddr_t vaddr,
                            int cur_perm,
                            int old_perm);
 struct region *copy_region(struct region* old_r);
-void add_region(struct addrspace *as, struct region *r);
+int add_region(struct addrspace *as, struct region *r);
 void remove_region(struct addrspace *as, struct region *r);
 void free_regions(struct addrspace *as);
 struct region *search_region(struct addrspace *as,
@@ -154,6 +227,26 @@ struct region *search_region(struct addrspace *as,
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_growstack - grow the stack down to cover VADDR, for a fault
+ *                at most USERSTACKREACH below it. Returns the stack
+ *                region, or NULL if VADDR is not within the stack's
+ *                reach.
+ *
+ *    as_define_file - back the region containing VADDR with FILESIZE
+ *                bytes of the file V starting at OFFSET. The pages are
+ *                read in lazily by vm_fault().
+ *
+ *    as_sbrk   - move the break by AMOUNT bytes, handing back the old
+ *                one. Pages are filled in lazily as the heap grows and
+ *                released as soon as it shrinks.
+ *
+ *    as_mmap   - map LENGTH bytes of the file V starting at OFFSET into
+ *                a new region, handing back its address.
+ *
+ *    as_munmap - write back and remove the mapping starting at VADDR.
+ *
+ *    as_syncfile - write back every mapping of the file V.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -172,6 +265,16 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+struct region    *as_growstack(struct addrspace *as, vaddr_t vaddr);
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t filesize);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, size_t length, int perm,
+                          struct vnode *v, off_t offset, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr);
+int               as_syncfile(struct addrspace *as, struct vnode *v);
 
 
 /*
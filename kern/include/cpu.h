@@ -154,7 +154,10 @@ void cpu_halt(void);
  *
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
- * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data; it
+ * fails with EAGAIN if the target's shootdown queue is full.
+ * ipi_tlbshootdown_cpus sends the same shootdown to each CPU whose
+ * number is set in a mask, and returns the mask of those it could not.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -168,7 +171,9 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+int ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+uint32_t ipi_tlbshootdown_cpus(uint32_t cpus,
+			       const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,40 @@
+#ifndef _HPT_H_
+#define _HPT_H_
+
+/*
+ * Hashed page table.
+ *
+ * With "options hpt" every address space shares one global page table sized
+ * to physical memory instead of owning a 3-level page table. Entries are
+ * keyed by (address space, virtual page) and hold the same page table entry
+ * format as the 3-level table (see vm.h), so everything above the lookup
+ * functions is unchanged.
+ *
+ * Entries do not move once inserted, so a pointer to one stays good until it
+ * is removed. Only the thread working on an address space removes its
+ * entries, and only entries that are zero.
+ */
+
+#include <vm.h>
+
+// Table entries per physical frame. Swapped out pages keep their entries, so
+// there is room for some of them besides the resident ones.
+#define HPT_ENTRIES_PER_FRAME 2
+
+/* Initialisation, called from vm_bootstrap() */
+void hpt_bootstrap(void);
+
+/* Entry for vaddr in as, or NULL if there is none */
+paddr_t *hpt_lookup(struct addrspace *as, vaddr_t vaddr);
+
+/* Entry for vaddr in as, adding a zero entry if there is none */
+int hpt_insert(struct addrspace *as, vaddr_t vaddr, paddr_t **ret);
+
+/* Remove the (zero) entry for vaddr in as */
+void hpt_remove(struct addrspace *as, vaddr_t vaddr);
+
+/* Iterate over the entries of as, starting with *pos = 0 */
+paddr_t *hpt_next(struct addrspace *as, unsigned *pos, vaddr_t *vaddr);
+
+
+#endif /* _HPT_H_ */
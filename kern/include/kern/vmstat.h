@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * Virtual memory event counters, as returned by __vmstat().
+ *
+ * Each counter is kept both system-wide and for each process. Fast
+ * TLB refills happen without entering C code and are only counted
+ * system-wide.
+ */
+#define VMSTAT_TLB_FAULTS     0  /* TLB misses handled by vm_fault() */
+#define VMSTAT_TLB_REFILLS    1  /* TLB misses handled by the fast path */
+#define VMSTAT_TLB_FLUSHES    2  /* whole TLB flushes */
+#define VMSTAT_ZERO_FILLS     3  /* first touches of anonymous pages */
+#define VMSTAT_PAGEINS        4  /* pages read in from a file */
+#define VMSTAT_MODIFY_FAULTS  5  /* first writes to clean pages */
+#define VMSTAT_COW_BREAKS     6  /* copy-on-write pages made private */
+#define VMSTAT_SWAPINS        7  /* pages read back from swap */
+#define VMSTAT_SWAPOUTS       8  /* pages written out to swap */
+#define VMSTAT_FRAMES_ALLOC   9  /* physical frames allocated */
+#define VMSTAT_FRAMES_FREED   10 /* physical frames freed */
+#define VMSTAT_TLB_SHOOTDOWNS 11 /* shootdowns sent to other CPUs */
+#define VMSTAT_SWAP_WRITES    12 /* requests writing pages to swap */
+#define VMSTAT_SWAP_READS     13 /* requests reading pages from swap */
+#define VMSTAT_SWAP_READAHEAD 14 /* pages read from swap ahead of a fault */
+#define VMSTAT_SWAP_USECS     15 /* microseconds spent on swap requests */
+#define VMSTAT_NUM            16
+
+/* Names of the counters, in order, for printing. */
+#define VMSTAT_NAMES { \
+	"tlb faults", "tlb refills", "tlb flushes", "zero fills", \
+	"page ins", "modify faults", "cow breaks", "swap ins", \
+	"swap outs", "frames allocated", "frames freed", "tlb shootdowns", \
+	"swap writes", "swap reads", "swap read ahead", "swap usecs" }
+
+/* "who" codes for __vmstat() */
+#define VMSTAT_SELF	0	/* the calling process */
+#define VMSTAT_ALL	1	/* the whole system */
+
+struct vmstat {
+	__counter_t vs_count[VMSTAT_NUM];
+};
+
+#endif /* _KERN_VMSTAT_H_ */
@@ -38,6 +38,7 @@
 
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
+#include <kern/vmstat.h> /* required for struct vmstat */
 
 struct addrspace;
 struct vnode;
@@ -60,6 +61,7 @@ struct proc {
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	struct vmstat p_vmstat;		/* VM event counters */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -0,0 +1,31 @@
+#ifndef _PTCACHE_H_
+#define _PTCACHE_H_
+
+/*
+ * Object caches for page table nodes and reverse map entries.
+ *
+ * A cache carves whole frames into objects of one size, so page tables do
+ * not go through kmalloc and do not fragment the kernel heap. Free objects
+ * are kept zeroed, apart from the free list link which is cleared when an
+ * object is handed out, so a new node needs no clearing. Each CPU keeps a
+ * short list of free objects in front of the shared frames.
+ */
+
+#include <vm.h>
+
+struct ptcache;
+
+/* Create a cache of zeroed objects of size bytes, NULL if out of memory */
+struct ptcache *ptcache_create(const char *name, size_t size);
+
+/* Allocate a zero-filled object, or return NULL if out of memory */
+void *ptcache_alloc(struct ptcache *pc);
+
+/* Free an object; it is zeroed again on the way back into the cache */
+void ptcache_free(struct ptcache *pc, void *obj);
+
+/* Print the usage of every cache, for the ptcache menu command */
+void ptcache_printstats(void);
+
+
+#endif /* _PTCACHE_H_ */
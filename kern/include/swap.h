@@ -0,0 +1,52 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages evicted from memory are written to page-sized slots on the swap
+ * device. A page table entry for a swapped page holds its slot number in the
+ * frame bits together with PTE_SWAPPED (see vm.h).
+ *
+ * The page out thread writes the pages it evicts in clusters of up to
+ * swap_cluster pages, sorted by address space and address, to consecutive
+ * slots with one request to the device. A page read back in brings the pages
+ * after it in the same cluster with it, if they are still swapped out, since
+ * they were virtually adjacent when they were written. Setting swap_cluster
+ * to 1 pages one page at a time.
+ */
+
+#include <vm.h>
+
+// Device or file the swap area lives on.
+#define SWAP_DEVICE "lhd0raw:"
+
+// Swap slot number to and from the frame bits of a page table entry.
+#define SWAP_SLOT_TO_PTE(slot) ((paddr_t)(slot) << 12)
+#define PTE_TO_SWAP_SLOT(pte)  ((unsigned)((pte) >> 12))
+
+// Pages written or read per request.
+#define SWAP_CLUSTER_DEFAULT 8
+#define SWAP_CLUSTER_MAX 16
+extern unsigned swap_cluster;
+
+/* Initialisation, called from vm_bootstrap() */
+void swap_bootstrap(void);
+
+/* Write the frame at kvaddr to a newly allocated slot */
+int swap_out(vaddr_t kvaddr, unsigned *slot);
+
+/* Write npages frames to newly allocated slots, all of them or none */
+int swap_out_cluster(const vaddr_t *kvaddrs, unsigned npages, unsigned *slots);
+
+/* Read a slot back into the frame at kvaddr */
+int swap_in(unsigned slot, vaddr_t kvaddr);
+
+/* Read npages consecutive slots into the frames at kvaddrs */
+int swap_in_cluster(unsigned slot, const vaddr_t *kvaddrs, unsigned npages);
+
+/* Release a slot that is no longer referenced */
+void swap_free(unsigned slot);
+
+
+#endif /* _SWAP_H_ */
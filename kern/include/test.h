@@ -98,6 +98,9 @@ int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int nettest(int, char **);
 
+/* VM tests */
+int faultbench(int, char **);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
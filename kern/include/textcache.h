@@ -0,0 +1,60 @@
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+/*
+ * Shared frames for the read-only segments of executables.
+ *
+ * Every process running the same executable maps the same frames for its
+ * text, so N copies of a program cost one set of text frames. A textfile
+ * describes one read-only, file backed segment: the vnode and where its data
+ * sits in the file and in memory. Regions of that segment in any address
+ * space hold a reference to it, and the cache holds a frame reference for
+ * every page it has read in. The frames go when the last region referencing
+ * the segment does, or earlier if memory runs out and no process maps them.
+ *
+ * Writes to an executable while it is running are not seen by pages that are
+ * already cached.
+ */
+
+#include <vm.h>
+
+struct vnode;
+struct textfile;
+
+/*
+ * Look up or create the textfile for a segment, returning a new reference
+ * to it, or NULL if out of memory.
+ */
+struct textfile *textfile_get(struct vnode *vn, off_t offset, vaddr_t vaddr,
+                              size_t filesize);
+
+/* Add a reference, e.g. for a region copied by fork */
+void textfile_incref(struct textfile *tf);
+
+/* Drop a reference; the last one frees the cached frames */
+void textfile_put(struct textfile *tf);
+
+/*
+ * Return the cached frame for the page at vaddr, mapped there in as, or 0 if
+ * it has not been read in yet.
+ */
+vaddr_t textfile_lookup(struct textfile *tf, struct addrspace *as,
+                        vaddr_t vaddr);
+
+/*
+ * Offer the unpinned frame kvaddr, just read in for the page at vaddr in as,
+ * to the cache. Returns the frame to map: kvaddr itself, or the frame another
+ * process cached first, which is then mapped in as instead and kvaddr freed.
+ * Returns kvaddr uncached if it cannot be shared.
+ */
+vaddr_t textfile_insert(struct textfile *tf, struct addrspace *as,
+                        vaddr_t vaddr, vaddr_t kvaddr);
+
+/* Free cached frames that no process maps; returns the number freed */
+unsigned textcache_shrink(void);
+
+/* Print cache usage, for the text menu command */
+void textcache_printstats(void);
+
+
+#endif /* _TEXTCACHE_H_ */
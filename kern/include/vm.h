@@ -33,8 +33,10 @@
 #include <machine/vm.h>
 #include <machine/tlb.h>
 #include <addrspace.h>
+#include "opt-hpt.h"
 
 struct addrspace;
+struct region;
 
 // Page number masks
 #define PG_IDX0(pg) (pg >> 24)       // mask to get first level from page number
@@ -44,6 +46,40 @@ struct addrspace;
 #define PG_SIZE_1   64               // number of pages in second level
 #define PG_SIZE_2   64               // number of pages in third level
 
+#if !OPT_HPT
+// A 1st level page table node. Each node counts the live entries of its 2nd
+// level tables so that teardown and fork can skip empty ones. The fast TLB
+// refill handler indexes pn_table as a plain array, so it has to come first.
+struct pgnode {
+    paddr_t *pn_table[PG_SIZE_1]; // 2nd level tables, NULL if not allocated.
+    uint8_t pn_live[PG_SIZE_1];   // Non-zero entries in each 2nd level table.
+    unsigned pn_tables;           // 2nd level tables allocated.
+};
+#endif
+
+/**
+ * TLB state of one CPU used by the fast refill handler in exception-mips1.S,
+ * which indexes vm_utlbcpu by CPU number << 4. Keep the layout in step.
+ */
+struct vm_utlbcpu {
+    struct pgnode **uc_table; // Page table to walk, NULL sends misses to vm_fault().
+    unsigned uc_next;         // Next TLB slot to replace, round-robin.
+    unsigned uc_refills;      // TLB misses handled without vm_fault().
+    vaddr_t uc_seq;           // Page a sequential run goes on to, 0 if none.
+};
+
+/**
+ * Pages of one address space whose translations are being dropped from the
+ * TLBs of all CPUs. Other CPUs are sent the batch as a single shootdown and
+ * clear their bit in tb_pending once they have dropped it.
+ */
+struct tlbbatch {
+    struct addrspace *tb_as;
+    vaddr_t tb_vaddr[TLBSHOOTDOWN_PAGES];
+    unsigned tb_npages;       // More than TLBSHOOTDOWN_PAGES: all of them.
+    uint32_t tb_pending;      // CPUs yet to handle the shootdown.
+};
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -58,6 +94,26 @@ struct addrspace;
 #define GET_DIRTY_BIT(perm) (((perm & R_WR) == R_WR) * TLBLO_DIRTY)
 #define GET_VALID_BIT(perm) ((((perm & R_RD) == R_RD) | ((perm & R_EX) == R_EX)) * TLBLO_VALID)
 
+// Software page table entry bits, never loaded into the TLB
+#define PTE_COW     0x00000001 // Page is writeable but shared copy-on-write
+#define PTE_SWAPPED 0x00000002 // Frame bits hold a swap slot, not a frame
+#define PTE_PAGING  0x00000004 // Frame is being written out to swap
+#define PTE_MODIFIED 0x00000008 // Page was written since it was filled
+#define PTE_REFERENCED 0x00000010 // Page was used since the clock hand passed
+
+// Writeable pages only get a writeable TLB entry once they are modified, so
+// the first write to a page faults and can be recorded.
+#define PTE_TO_TLBLO(pte) ((pte & (TLBLO_PPAGE | TLBLO_VALID)) | \
+    (((pte & (TLBLO_DIRTY | PTE_MODIFIED)) == (TLBLO_DIRTY | PTE_MODIFIED)) * \
+    TLBLO_DIRTY))
+#define PTE_RESIDENT(pte) (pte != 0 && (pte & (PTE_SWAPPED | PTE_PAGING)) == 0)
+
+// Page number from page table indexes, the inverse of PG_IDX0/1/2
+#define PG_KEY(i0, i1, i2) (((i0) << 24) | ((i1) << 18) | ((i2) << 12))
+
+// Page table keys are KVADDR_TO_PADDR(vaddr), this turns one back
+#define PG_KEY_TO_VADDR(key) PADDR_TO_KVADDR(key)
+
 // Page permissions to region permissions
 #define GET_WRITE_BIT(paddr) (((paddr & TLBLO_DIRTY) == TLBLO_DIRTY) * R_WR)
 #define GET_READ_BIT(paddr)  (((paddr & TLBLO_VALID) == TLBLO_VALID) * R_RD) // This is also used for the R_EX bit
@@ -66,6 +122,45 @@ struct addrspace;
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+// Free many single user frames at once, e.g. when an address space goes away
+void free_kpages_batch(const vaddr_t *addrs, unsigned count);
+
+// Add a reference to a single frame that the reverse map does not record
+int share_kpages(vaddr_t addr);
+unsigned kpages_refcount(vaddr_t addr);
+
+// Allocate evictable frames for user pages, returned pinned
+vaddr_t alloc_upage(struct addrspace *as, vaddr_t vaddr);
+void unpin_upage(vaddr_t addr);
+
+// A frame for a page read ahead, only if free memory is plentiful
+vaddr_t alloc_upage_ahead(struct addrspace *as, vaddr_t vaddr);
+
+// Map a user frame at vaddr in another address space (copy-on-write, shared
+// text) and unmap it again, keeping the reverse map from frames to mappings
+void rmap_bootstrap(void);
+int share_upage(vaddr_t addr, struct addrspace *as, vaddr_t vaddr);
+void free_upage(vaddr_t addr, struct addrspace *as, vaddr_t vaddr);
+void free_upages_batch(struct addrspace *as, const vaddr_t *addrs,
+                       const vaddr_t *vaddrs, unsigned count);
+void rmap_printframe(uint32_t frame);
+
+// Zero-filled frames for user pages, mostly zeroed ahead of time by a thread
+// the idle loop wakes
+vaddr_t alloc_zeroed_upage(struct addrspace *as, vaddr_t vaddr);
+int zero_pool_wake(void);
+void zero_pool_printstats(void);
+
+// Clock page replacement statistics
+void clock_printstats(void);
+
+// Page out thread, keeping free frames between its watermarks
+void pageout_bootstrap(void);
+void pageout_printstats(void);
+
+// Free frames by buddy block size
+void buddy_printstats(void);
+
 /* Initialization function */
 void vm_bootstrap(void);
 
@@ -78,10 +173,52 @@ void vm_tlbshootdown(const struct tlbshootdown *);
 // TLB shluld be flushed to protect process memory after a context switch.
 void vm_tlbflush(void);
 
+// Remove the TLB entry of a single page from this CPU's TLB.
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr);
+
+// Remove the TLB entries of a batch of pages from every CPU's TLB.
+void vm_tlbbatch_init(struct tlbbatch *tb, struct addrspace *as);
+void vm_tlbbatch_add(struct tlbbatch *tb, vaddr_t vaddr);
+void vm_tlbbatch_flush(struct tlbbatch *tb);
+
+// Address space IDs tagging TLB entries.
+void vm_asidactivate(struct addrspace *as);
+void vm_asidflush(struct addrspace *as);
+void vm_asiddeactivate(struct addrspace *as);
+void vm_tlbprintstats(void);
+
+// Per-CPU state shared with the fast refill handler.
+extern struct vm_utlbcpu vm_utlbcpu[VM_CPUS];
+
+// Pages vm_fault() may map ahead of a sequential run of faults, 0 for none.
+#define FAULTAROUND_DEFAULT 8
+#define FAULTAROUND_MAX 32
+extern unsigned vm_faultaround_max;
+
+// Shared frame of zeroes, mapped by untouched anonymous pages.
+extern vaddr_t vm_zeropage;
+
+/* Page out support, called by the frame allocator while evicting */
+int vm_pageref(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+int vm_pageout_begin(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+                     paddr_t *oldpte);
+void vm_pageout_shootdown(struct addrspace *as, vaddr_t vaddr);
+void vm_pageout_end(struct addrspace *as, vaddr_t vaddr, paddr_t pte);
+
+/* Write back a modified page of a file mapping */
+int vm_writeback(struct addrspace *as, struct region *r, vaddr_t vaddr);
+
 /* Page table functions */
+#if !OPT_HPT
 int vm_allocpte1(struct addrspace *as, paddr_t paddr);
 int vm_allocpte2(struct addrspace *as, paddr_t paddr);
+void vm_freepte1(struct addrspace *as, paddr_t paddr);
+void vm_freepte2(struct addrspace *as, paddr_t paddr);
+#endif
 int vm_allocpte3(struct addrspace *as, paddr_t paddr, int perm);
 
+// Count an entry becoming live (delta 1) or being cleared (delta -1).
+void vm_ptecount(struct addrspace *as, vaddr_t vaddr, int delta);
+
 
 #endif /* _VM_H_ */
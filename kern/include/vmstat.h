@@ -0,0 +1,27 @@
+#ifndef _VMSTAT_H_
+#define _VMSTAT_H_
+
+/*
+ * Virtual memory statistics.
+ *
+ * Each CPU counts events in its own slot with interrupts off, so counting
+ * takes no locks and CPUs never write the same counters. The same events are
+ * also counted in the process they happen on (struct proc p_vmstat). Totals
+ * are summed from the per-CPU slots when they are read. The counter numbers
+ * are in <kern/vmstat.h> so that userland can read them with __vmstat().
+ */
+
+#include <kern/vmstat.h>
+
+/* Count N events of kind WHICH on the current CPU and process */
+void vmstat_add(unsigned which, unsigned n);
+#define vmstat_inc(which) vmstat_add(which, 1)
+
+/* Sum the per-CPU counters into VS */
+void vmstat_total(struct vmstat *vs);
+
+/* Print the totals and a per-CPU breakdown, for the vmstat menu command */
+void vmstat_printstats(void);
+
+
+#endif /* _VMSTAT_H_ */
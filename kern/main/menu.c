@@ -45,8 +45,14 @@
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <vmstat.h>
+#include <ptcache.h>
+#include <textcache.h>
+#include <swap.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -500,6 +506,155 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_clockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	clock_printstats();
+	pageout_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_tlbprintstats();
+
+	return 0;
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	unsigned pages;
+
+	if (nargs == 2) {
+		pages = atoi(args[1]);
+		if (pages > FAULTAROUND_MAX) {
+			kprintf("faultaround: at most %u pages\n",
+				FAULTAROUND_MAX);
+			return EINVAL;
+		}
+		vm_faultaround_max = pages;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: faultaround [pages]\n");
+		return EINVAL;
+	}
+
+	kprintf("Fault-around window: up to %u pages\n", vm_faultaround_max);
+	return 0;
+}
+
+static
+int
+cmd_swapcluster(int nargs, char **args)
+{
+	unsigned pages;
+
+	if (nargs == 2) {
+		pages = atoi(args[1]);
+		if (pages < 1 || pages > SWAP_CLUSTER_MAX) {
+			kprintf("swapcluster: 1 to %u pages\n",
+				SWAP_CLUSTER_MAX);
+			return EINVAL;
+		}
+		swap_cluster = pages;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: swapcluster [pages]\n");
+		return EINVAL;
+	}
+
+	kprintf("Swap cluster: up to %u pages\n", swap_cluster);
+	return 0;
+}
+
+static
+int
+cmd_zerostats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	zero_pool_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_buddystats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buddy_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstat_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_ptcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	ptcache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_rmap(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: rmap frame-number\n");
+		return EINVAL;
+	}
+
+	rmap_printframe(atoi(args[1]));
+
+	return 0;
+}
+
+static
+int
+cmd_textcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	textcache_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -584,6 +739,9 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+#if !OPT_DUMBVM
+	"[fb]  Fault benchmark               ",
+#endif
 	NULL
 };
 
@@ -606,6 +764,18 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+#if !OPT_DUMBVM
+	"[clock] Page replacement stats      ",
+	"[tlb] TLB stats                     ",
+	"[faultaround] Set fault-around size ",
+	"[swapcluster] Set swap cluster size ",
+	"[zero] Zero pool stats              ",
+	"[buddy] Free frame histogram        ",
+	"[vmstat] VM event counters          ",
+	"[ptcache] Page table cache stats    ",
+	"[text] Shared text cache stats      ",
+	"[rmap] Mappings of a frame          ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +827,18 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+#if !OPT_DUMBVM
+	{ "clock",      cmd_clockstats },
+	{ "tlb",        cmd_tlbstats },
+	{ "faultaround", cmd_faultaround },
+	{ "swapcluster", cmd_swapcluster },
+	{ "zero",       cmd_zerostats },
+	{ "buddy",      cmd_buddystats },
+	{ "vmstat",     cmd_vmstat },
+	{ "ptcache",    cmd_ptcachestats },
+	{ "text",       cmd_textcachestats },
+	{ "rmap",       cmd_rmap },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -716,6 +898,11 @@ static struct {
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
 
+	/* VM assignment tests */
+#if !OPT_DUMBVM
+	{ "fb",		faultbench },
+#endif
+
 	{ NULL, NULL }
 };
 
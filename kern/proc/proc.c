@@ -90,6 +90,7 @@ proc_create(const char *name)
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	bzero(&proc->p_vmstat, sizeof(proc->p_vmstat));
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Virtual memory syscalls. The work is done by the address space
+ * code in vm/addrspace.c; these are not built with dumbvm.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vmstat.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/* mmap protection bits, as in userland <unistd.h> */
+#define PROT_READ 1
+#define PROT_WRITE 2
+
+/*
+ * sbrk - move the end of the heap by AMOUNT bytes and return the old
+ * end.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * mmap - map LENGTH bytes of the open file FD starting at OFFSET into
+ * the address space and return the address.
+ *
+ * There is no flags argument; all mappings are shared, so changes
+ * reach the file on munmap, fsync, or exit. The file must be open for
+ * reading, and for writing too if the mapping is writeable.
+ *
+ * The TLB cannot make a page writeable but not readable, so
+ * PROT_WRITE implies PROT_READ. A mapping with neither is refused, as
+ * every access to it would fault without end.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct openfile *file;
+	int perm;
+	int err;
+
+	if ((prot & ~(PROT_READ | PROT_WRITE)) != 0 || prot == 0) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	err = filetable_get(curproc->p_filetable, fd, &file);
+	if (err) {
+		return err;
+	}
+
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	/* ask the file system whether the file can be mapped */
+	err = VOP_MMAP(file->of_vnode);
+	if (err) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return err;
+	}
+
+	perm = R_RD | ((prot & PROT_WRITE) ? R_WR : 0);
+	err = as_mmap(as, length, perm, file->of_vnode, offset, retval);
+	filetable_put(curproc->p_filetable, fd, file);
+	return err;
+}
+
+/*
+ * munmap - remove the mapping starting at ADDR.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	return as_munmap(as, (vaddr_t)addr);
+}
+
+/*
+ * __vmstat - copy out the VM event counters of the calling process
+ * (VMSTAT_SELF) or of the whole system (VMSTAT_ALL).
+ */
+int
+sys___vmstat(int who, userptr_t buf)
+{
+	struct vmstat vs;
+
+	switch (who) {
+	    case VMSTAT_SELF:
+		/* our own counters only change while we are running */
+		vs = curproc->p_vmstat;
+		break;
+	    case VMSTAT_ALL:
+		vmstat_total(&vs);
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	return copyout(&vs, buf, sizeof(vs));
+}
@@ -0,0 +1,146 @@
+/*
+ * Fault microbenchmark.
+ *
+ * Times the region lookup vm_fault() does on every first touch, and the
+ * first-touch faults themselves, in address spaces with more and more
+ * regions. With regions kept sorted and binary searched, both should stay
+ * about flat as the region count grows.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <test.h>
+
+#define FB_BASE       0x00400000            /* address of the first region */
+#define FB_PAGES      64                    /* pages per region */
+#define FB_STRIDE     ((FB_PAGES + 1) * PAGE_SIZE) /* leave a gap between */
+#define FB_LOOKUPS    20000                 /* lookups timed per run */
+#define FB_FAULTS     FB_PAGES              /* faults timed per run */
+
+static const unsigned fb_sizes[] = { 1, 16, 256, 2048 };
+
+/*
+ * Average of a duration over COUNT operations, in nanoseconds.
+ */
+static
+uint32_t
+fb_average(const struct timespec *ts, unsigned count)
+{
+	uint64_t ns;
+
+	ns = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+	return (uint32_t)(ns / count);
+}
+
+/*
+ * Region touched by the Ith lookup or fault. Successive ones land in
+ * different regions so the last-hit cache does not hide the search.
+ */
+static
+vaddr_t
+fb_region(unsigned i, unsigned nregions)
+{
+	return FB_BASE + ((i * 7919) % nregions) * FB_STRIDE;
+}
+
+static
+int
+fb_run(unsigned nregions)
+{
+	struct addrspace *as, *oldas;
+	struct timespec before, after;
+	uint32_t lookup_ns, fault_ns;
+	vaddr_t vaddr;
+	unsigned i;
+	char c;
+	int result;
+
+	as = as_create();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	for (i = 0; i < nregions; i++) {
+		result = as_define_region(as, FB_BASE + i * FB_STRIDE,
+					  FB_PAGES * PAGE_SIZE, R_RD, R_WR, 0);
+		if (result) {
+			as_destroy(as);
+			return result;
+		}
+	}
+
+	/* The lookup on its own. */
+	gettime(&before);
+	for (i = 0; i < FB_LOOKUPS; i++) {
+		vaddr = fb_region(i, nregions);
+		if (search_region(as, vaddr, 0) == NULL) {
+			panic("faultbench: region at 0x%x not found\n", vaddr);
+		}
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+	lookup_ns = fb_average(&after, FB_LOOKUPS);
+
+	/*
+	 * First-touch faults, one on each of FB_FAULTS different
+	 * pages. Borrow the kernel process to run in the address
+	 * space for the duration.
+	 */
+	oldas = proc_setas(as);
+	as_activate();
+
+	c = 0;
+	result = 0;
+	gettime(&before);
+	for (i = 0; i < FB_FAULTS && result == 0; i++) {
+		vaddr = fb_region(i, nregions) + i * PAGE_SIZE;
+		result = copyout(&c, (userptr_t)vaddr, sizeof(c));
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+	fault_ns = fb_average(&after, FB_FAULTS);
+
+	proc_setas(oldas);
+	as_deactivate();
+	as_activate();
+	as_destroy(as);
+
+	if (result) {
+		return result;
+	}
+
+	kprintf("faultbench: %4u regions: %6u ns/lookup, %6u ns/fault\n",
+		nregions, lookup_ns, fault_ns);
+
+	return 0;
+}
+
+int
+faultbench(int nargs, char **args)
+{
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting fault benchmark...\n");
+
+	for (i = 0; i < sizeof(fb_sizes) / sizeof(fb_sizes[0]); i++) {
+		result = fb_run(fb_sizes[i]);
+		if (result) {
+			kprintf("faultbench: %u regions: %s\n", fb_sizes[i],
+				strerror(result));
+			return result;
+		}
+	}
+
+	kprintf("Fault benchmark done.\n");
+
+	return 0;
+}
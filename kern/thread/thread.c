@@ -53,6 +53,8 @@
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid.h>
+#include <vm.h>
+#include "opt-dumbvm.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -639,6 +641,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before idling, wake the VM system's zeroing thread if its
+	 * zero pool wants another frame; it runs with interrupts on,
+	 * unlike this loop, and then we look at the runqueue again.
 	 */
 
 	/* The current cpu is now idle. */
@@ -647,6 +653,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if !OPT_DUMBVM
+			if (zero_pool_wake()) {
+				spinlock_acquire(&curcpu->c_runqueue_lock);
+				continue;
+			}
+#endif
 			cpu_idle();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
@@ -1134,9 +1146,12 @@ ipi_broadcast(int code)
 }
 
 /*
- * Send a TLB shootdown IPI to the specified CPU.
+ * Send a TLB shootdown IPI to the specified CPU. Returns EAGAIN,
+ * without sending anything, if the CPU already has TLBSHOOTDOWN_MAX
+ * shootdowns queued; the caller should try again once it has handled
+ * some, with interrupts on in case the target is waiting on it.
  */
-void
+int
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	unsigned n;
@@ -1145,26 +1160,40 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 
 	n = target->c_numshootdown;
 	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		spinlock_release(&target->c_ipi_lock);
+		return EAGAIN;
 	}
+	target->c_shootdown[n] = *mapping;
+	target->c_numshootdown = n+1;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+	return 0;
+}
+
+/*
+ * Send a TLB shootdown IPI to each CPU whose number is set in CPUS.
+ * Returns the CPUs whose queue was full, which were not sent it.
+ */
+uint32_t
+ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+	uint32_t full;
+
+	full = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_number < 32 && (cpus & ((uint32_t)1 << c->c_number))) {
+			if (ipi_tlbshootdown(c, mapping)) {
+				full |= (uint32_t)1 << c->c_number;
+			}
+		}
+	}
+	return full;
 }
 
 /*
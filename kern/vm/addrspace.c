@@ -27,8 +27,11 @@
  * SUCH DAMAGE.
  */
 
+#define ADDRSPACEINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -37,6 +40,11 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <vnode.h>
+#include <wchan.h>
+#include <swap.h>
+#include <hpt.h>
+#include <textcache.h>
 
 struct region *init_region(vaddr_t vaddr,
                            size_t memsize,
@@ -54,126 +62,455 @@ struct region *init_region(vaddr_t vaddr,
     r->memsize = memsize;
     r->cur_perm = cur_perm;
     r->old_perm = old_perm;
-    r->next = NULL;
+    r->vn = NULL;
+    r->file_offset = 0;
+    r->file_vaddr = 0;
+    r->file_size = 0;
+    r->mapped = 0;
+    r->text = NULL;
 
     return r;
 }
 
 /**
  * Copies an old region to a new region and returns its pointer.
- * 
- * Note this does not copy over the next pointer. Next must be updated manually
- * outside this function.
  */
 struct region *copy_region(struct region* old_r) {
-    return init_region(old_r->vaddr,
-                       old_r->memsize,
-                       old_r->cur_perm,
-                       old_r->old_perm);
+    struct region *r;
+
+    r = init_region(old_r->vaddr,
+                    old_r->memsize,
+                    old_r->cur_perm,
+                    old_r->old_perm);
+    if (r == NULL) {
+        return NULL;
+    }
+
+    // Both regions page in from the same file.
+    if (old_r->vn != NULL) {
+        VOP_INCREF(old_r->vn);
+        r->vn = old_r->vn;
+        r->file_offset = old_r->file_offset;
+        r->file_vaddr = old_r->file_vaddr;
+        r->file_size = old_r->file_size;
+        r->mapped = old_r->mapped;
+    }
+
+    // And share the same cached text frames.
+    if (old_r->text != NULL) {
+        textfile_incref(old_r->text);
+        r->text = old_r->text;
+    }
+
+    return r;
+}
+
+/**
+ * Frees a region that is not (or no longer) in an address space.
+ */
+static void free_region(struct region *r) {
+    if (r->text != NULL) {
+        textfile_put(r->text);
+    }
+    if (r->vn != NULL) {
+        VOP_DECREF(r->vn);
+    }
+    kfree(r);
+}
+
+/**
+ * Binary searches the sorted regions for the first one starting above vaddr.
+ * The only region that can contain vaddr is the one before it.
+ */
+static unsigned find_region(struct addrspace *as, vaddr_t vaddr) {
+    unsigned lo;
+    unsigned hi;
+    unsigned mid;
+
+    lo = 0;
+    hi = regionarray_num(&as->regions);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (regionarray_get(&as->regions, mid)->vaddr <= vaddr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
 }
 
 /**
- * Adds regions to the end of the linked list.
+ * Returns true if any region overlaps vaddr to vaddr + memsize.
  */
-void add_region(struct addrspace *as, struct region *r) {
-    struct region *cur;
+static int overlap_region(struct addrspace *as, vaddr_t vaddr, size_t memsize) {
+    struct region *r;
+    unsigned idx;
 
-    cur = as->regions; // Head of list.
+    idx = find_region(as, vaddr);
 
-    // Head of linked list is NULL.
-    if (cur == NULL) {
-        as->regions = r;
-        return;
+    // Region starting at or below vaddr.
+    if (idx > 0) {
+        r = regionarray_get(&as->regions, idx - 1);
+        if (r->vaddr + r->memsize > vaddr) {
+            return 1;
+        }
     }
 
-    // Iterate linked list.
-    while (cur->next != NULL) {
-        cur = cur->next;
+    // Region starting above vaddr.
+    if (idx < regionarray_num(&as->regions)) {
+        r = regionarray_get(&as->regions, idx);
+        if (r->vaddr < vaddr + memsize) {
+            return 1;
+        }
     }
 
-    // Add region to end of linked list.
-    cur->next = r;
+    return 0;
 }
 
 /**
- * Removes a region anywhere within the linked list.
+ * Adds a region to the address space, keeping the regions sorted.
  */
-void remove_region(struct addrspace *as, struct region *r) {
-    struct region *cur;
-    struct region *prv;
+int add_region(struct addrspace *as, struct region *r) {
+    unsigned idx;
+    unsigned i;
+    int result;
 
-    cur = as->regions; // Head of list.
-    prv = NULL;
+    idx = find_region(as, r->vaddr);
 
-    // Empty list.
-    if (cur == NULL) {
-        return;
+    // Grow the array and slide the regions above r up by one.
+    result = regionarray_setsize(&as->regions,
+                                 regionarray_num(&as->regions) + 1);
+    if (result != 0) {
+        return result;
     }
 
-    // Find region.
-    while (cur != NULL && cur != r) {
-        prv = cur;
-        cur = cur->next;
+    for (i = regionarray_num(&as->regions) - 1; i > idx; i--) {
+        regionarray_set(&as->regions, i, regionarray_get(&as->regions, i - 1));
     }
+    regionarray_set(&as->regions, idx, r);
 
-    // Reached end of list and did not find region.
-    if (cur == NULL) {
+    return 0;
+}
+
+/**
+ * Removes a region from the address space and frees it.
+ */
+void remove_region(struct addrspace *as, struct region *r) {
+    unsigned idx;
+
+    // Find region, the last one starting at or below its address.
+    idx = find_region(as, r->vaddr);
+    if (idx == 0 || regionarray_get(&as->regions, idx - 1) != r) {
         return;
     }
 
-    // Relink the list.
-    if (prv == NULL) {
-        as->regions = cur->next; // empty list case
-    } else {
-        prv->next = cur->next;
+    regionarray_remove(&as->regions, idx - 1);
+    if (as->as_lastregion == r) {
+        as->as_lastregion = NULL;
     }
 
-    // Remove region.
-    kfree(cur);
-    cur = NULL;
+    free_region(r);
 }
 
 /**
  * Free all regions in the address space.
  */
 void free_regions(struct addrspace *as) {
-    struct region *cur;
-    struct region *tmp;
+    unsigned i;
 
-    cur = as->regions; // start of linked list
-    while (cur != NULL) {
-        tmp = cur;
-        cur = cur->next;
-        kfree(tmp);
-        tmp = NULL;
+    for (i = 0; i < regionarray_num(&as->regions); i++) {
+        free_region(regionarray_get(&as->regions, i));
     }
+
+    // Shrinking never fails.
+    regionarray_setsize(&as->regions, 0);
+    as->as_lastregion = NULL;
 }
 
 /**
  * search_region() returns a region from the address space if there exists a
  * region that is a superset of the given vaddr and memsize.
  * 
- * Returns NULL if region is not found. This also indicates that a region
- * allocation will be valid.
+ * Returns NULL if region is not found.
+ *
+ * The region found last time is tried first since faults tend to come in runs
+ * within one region; otherwise the regions are binary searched.
  */
 struct region *search_region(struct addrspace *as,
                                     vaddr_t vaddr,
                                     size_t memsize) {
-    struct region *cur;
+    struct region *r;
+    unsigned idx;
+
+    r = as->as_lastregion;
+    if (r != NULL && vaddr >= r->vaddr &&
+        ((vaddr + memsize) <= (r->vaddr + r->memsize))) {
+        return r;
+    }
+
+    idx = find_region(as, vaddr);
+    if (idx == 0) {
+        return NULL; // could not find region
+    }
+
+    // Check if the candidate's vaddr and memsize is a superset of the given
+    // vaddr and memsize.
+    r = regionarray_get(&as->regions, idx - 1);
+    if ((vaddr + memsize) > (r->vaddr + r->memsize)) {
+        return NULL; // could not find region
+    }
+
+    as->as_lastregion = r;
+    return r;
+}
+
+/**
+ * Copies the page table entry old_pte of old_as into new_pte of new_as, for
+ * the page at vaddr.
+ *
+ * Resident frames are shared copy-on-write: writeable pages become read-only
+ * in both address spaces until one of them writes to the page. Swapped out
+ * pages are read back into a private frame for the new address space.
+ */
+static int copy_pte(struct addrspace *old_as, paddr_t *old_pte,
+                    struct addrspace *new_as, paddr_t *new_pte,
+                    vaddr_t vaddr) {
+    paddr_t entry;
+    vaddr_t frame;
+    int result;
+
+    while (1) {
+        spinlock_acquire(&old_as->as_lock);
+        while ((*old_pte & PTE_PAGING) != 0) {
+            wchan_sleep(old_as->as_wchan, &old_as->as_lock);
+        }
+        entry = *old_pte;
+        spinlock_release(&old_as->as_lock);
+
+        if (entry == 0) {
+            return 0;
+        }
+
+        if ((entry & PTE_SWAPPED) != 0) {
+            frame = alloc_upage(new_as, vaddr);
+            if (frame == 0) {
+                return ENOMEM;
+            }
+
+            result = swap_in(PTE_TO_SWAP_SLOT(entry), frame);
+            if (result != 0) {
+                free_kpages(frame);
+                return result;
+            }
+
+            *new_pte = KVADDR_TO_PADDR(frame) | TLBLO_VALID | PTE_MODIFIED |
+                PTE_REFERENCED | (((entry & (TLBLO_DIRTY | PTE_COW)) != 0) * TLBLO_DIRTY);
+            vm_ptecount(new_as, vaddr, 1);
+            unpin_upage(frame);
+            return 0;
+        }
+
+        // Sharing the frame stops it being paged out. If it is already on
+        // its way out, wait for the page out and look again. Mappings of the
+        // zero page are not worth recording in the reverse map.
+        frame = PADDR_TO_KVADDR(entry & PAGE_FRAME);
+        if (frame == vm_zeropage) {
+            result = share_kpages(frame);
+        } else {
+            result = share_upage(frame, new_as, vaddr);
+        }
+        if (result == EBUSY) {
+            continue;
+        }
+        if (result != 0) {
+            return result;
+        }
+
+        spinlock_acquire(&old_as->as_lock);
+        if (*old_pte != entry) {
+            spinlock_release(&old_as->as_lock);
+            free_upage(frame, new_as, vaddr);
+            continue;
+        }
+        if ((entry & TLBLO_DIRTY) == TLBLO_DIRTY) {
+            *old_pte = (entry & ~TLBLO_DIRTY) | PTE_COW;
+        }
+        *new_pte = *old_pte;
+        vm_ptecount(new_as, vaddr, 1);
+        spinlock_release(&old_as->as_lock);
+
+        return 0;
+    }
+}
+
+/**
+ * Clears the page table entry for vaddr, waiting for any page out of the entry
+ * to finish first, and returns what it held.
+ */
+static paddr_t clear_pte(struct addrspace *as, paddr_t *pte, vaddr_t vaddr) {
+    paddr_t entry;
+
+    spinlock_acquire(&as->as_lock);
+    while ((*pte & PTE_PAGING) != 0) {
+        wchan_sleep(as->as_wchan, &as->as_lock);
+    }
+    entry = *pte;
+    *pte = 0;
+    if (entry != 0) {
+        vm_ptecount(as, vaddr, -1);
+    }
+    spinlock_release(&as->as_lock);
+
+    return entry;
+}
+
+/**
+ * Releases the frame or swap slot held by the page table entry for vaddr,
+ * which has been cleared.
+ */
+static void release_pte(struct addrspace *as, paddr_t entry, vaddr_t vaddr) {
+    if ((entry & PTE_SWAPPED) != 0) {
+        swap_free(PTE_TO_SWAP_SLOT(entry));
+    } else if (entry != 0) {
+        free_upage(PADDR_TO_KVADDR(entry & PAGE_FRAME), as, vaddr);
+    }
+}
+
+/**
+ * Clears the page table entry for vaddr and releases the frame or swap slot it
+ * holds. Only for address spaces no CPU can have translations of any more.
+ */
+static void free_pte(struct addrspace *as, paddr_t *pte, vaddr_t vaddr) {
+    release_pte(as, clear_pte(as, pte, vaddr), vaddr);
+}
+
+/**
+ * Releases the frames and swap slots of the pages from start up to end,
+ * which no region covers any more.
+ *
+ * Other CPUs may still have translations of the pages, so the entries are
+ * cleared a batch at a time and their frames only freed once the batch has
+ * been shot down.
+ */
+static void free_pages(struct addrspace *as, vaddr_t start, vaddr_t end) {
+    struct tlbbatch tb;
+    paddr_t entries[TLBSHOOTDOWN_PAGES];
+    vaddr_t vaddrs[TLBSHOOTDOWN_PAGES];
+    unsigned nentries;
+    unsigned i;
+    paddr_t *pte;
+    vaddr_t vaddr;
+#if !OPT_HPT
+    paddr_t paddr;
+#endif
+
+    vm_tlbbatch_init(&tb, as);
+    nentries = 0;
+
+    for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+#if OPT_HPT
+        pte = hpt_lookup(as, vaddr);
+#else
+        paddr = KVADDR_TO_PADDR(vaddr);
+        pte = NULL;
+        if (as->pgtable[PG_IDX0(paddr)] != NULL &&
+            as->pgtable[PG_IDX0(paddr)]->pn_table[PG_IDX1(paddr)] != NULL) {
+            pte = &as->pgtable[PG_IDX0(paddr)]->pn_table[PG_IDX1(paddr)][PG_IDX2(paddr)];
+        }
+#endif
+        if (pte == NULL) {
+            continue;
+        }
 
-    cur = as->regions; // start of linked list
-    while (cur != NULL) {
+        entries[nentries] = clear_pte(as, pte, vaddr);
+#if OPT_HPT
+        hpt_remove(as, vaddr);
+#endif
+        if (entries[nentries] == 0) {
+            continue;
+        }
+        vaddrs[nentries] = vaddr;
+        // Only resident pages can be in a TLB.
+        if (PTE_RESIDENT(entries[nentries])) {
+            vm_tlbbatch_add(&tb, vaddr);
+        }
 
-        // Check if cur's vaddr and memsize is a superset of the given vaddr
-        // and memsize.
-        if (vaddr >= cur->vaddr &&
-            ((vaddr + memsize) <= (cur->vaddr + cur->memsize))) {
-            return cur;
+        if (++nentries == TLBSHOOTDOWN_PAGES) {
+            vm_tlbbatch_flush(&tb);
+            for (i = 0; i < nentries; i++) {
+                release_pte(as, entries[i], vaddrs[i]);
+            }
+            nentries = 0;
         }
-        cur = cur->next;
     }
 
-    return NULL; // could not find region
+    vm_tlbbatch_flush(&tb);
+    for (i = 0; i < nentries; i++) {
+        release_pte(as, entries[i], vaddrs[i]);
+    }
+}
+
+#if !OPT_HPT
+/**
+ * Clears the entries of 2nd level page table j of node, the 1st level node at
+ * index i, and releases what they hold. Frames go back to the allocator in a
+ * single batch. The scan stops as soon as the table has no live entries left.
+ */
+static void free_table(struct addrspace *as, struct pgnode *node, int i,
+                       int j) {
+    vaddr_t frames[PG_SIZE_2];
+    vaddr_t vaddrs[PG_SIZE_2];
+    unsigned nframes;
+    paddr_t *table;
+    paddr_t entry;
+    int k;
+
+    table = node->pn_table[j];
+    nframes = 0;
+
+    spinlock_acquire(&as->as_lock);
+    for (k = 0; k < PG_SIZE_2 && node->pn_live[j] > 0; k++) {
+        while ((table[k] & PTE_PAGING) != 0) {
+            wchan_sleep(as->as_wchan, &as->as_lock);
+        }
+        entry = table[k];
+        if (entry == 0) {
+            continue;
+        }
+
+        table[k] = 0;
+        node->pn_live[j]--;
+        if ((entry & PTE_SWAPPED) != 0) {
+            swap_free(PTE_TO_SWAP_SLOT(entry));
+        } else {
+            frames[nframes] = PADDR_TO_KVADDR(entry & PAGE_FRAME);
+            vaddrs[nframes] = PG_KEY_TO_VADDR(PG_KEY(i, j, k));
+            nframes++;
+        }
+    }
+    spinlock_release(&as->as_lock);
+
+    free_upages_batch(as, frames, vaddrs, nframes);
+}
+#endif
+
+/**
+ * Writes every modified page of a mapped region back to its file.
+ */
+static int sync_region(struct addrspace *as, struct region *r) {
+    vaddr_t vaddr;
+    int result;
+
+    for (vaddr = r->vaddr; vaddr < r->vaddr + r->memsize; vaddr += PAGE_SIZE) {
+        result = vm_writeback(as, r, vaddr);
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    return 0;
 }
 
 /*
@@ -197,9 +534,10 @@ struct addrspace *as_create(void) {
         goto cleanupA;
     }
 
+#if !OPT_HPT
     // Memory allocate the page table for the address space.
     as->pgtable = NULL;
-    as->pgtable = (paddr_t ***)kmalloc(PG_SIZE_0 * sizeof(paddr_t));
+    as->pgtable = kmalloc(PG_SIZE_0 * sizeof(struct pgnode *));
     if (as->pgtable == NULL) {
         goto cleanupB;
     }
@@ -208,13 +546,37 @@ struct addrspace *as_create(void) {
     for (i = 0; i < PG_SIZE_0; i++) {
         as->pgtable[i] = NULL; // Zero-fill the first page.
     }
+    as->as_pgnodes = 0;
+#endif
+
+    as->as_wchan = wchan_create("as");
+    if (as->as_wchan == NULL) {
+        goto cleanupC;
+    }
+    spinlock_init(&as->as_lock);
+
+    // An ASID is assigned on each CPU when the address space is first
+    // activated there.
+    for (i = 0; i < VM_CPUS; i++) {
+        as->as_context[i] = 0;
+    }
+    as->as_cpus = 0;
 
     // Memory allocation will come as needed.
-    as->regions = NULL;
+    regionarray_init(&as->regions);
+    as->as_lastregion = NULL;
+    as->as_heap = NULL;
+    as->as_heapend = 0;
+    as->as_stack = NULL;
 
     return as;
 
+cleanupC:
+#if !OPT_HPT
+    kfree(as->pgtable);
+
 cleanupB:
+#endif
     kfree(as);
     as = NULL;
 
@@ -224,13 +586,22 @@ cleanupA:
 
 int as_copy(struct addrspace *old_as, struct addrspace **ret) {
     struct addrspace *new_as;
-    struct region *r_cur;
-    struct region *r_prv;
-    paddr_t paddr;
-    int perm;
+    struct region *r;
+    unsigned idx;
+#if OPT_HPT
+    paddr_t *old_pte;
+    paddr_t *new_pte;
+    vaddr_t vaddr;
+    unsigned pos;
+#else
+    struct pgnode *old_node;
+    unsigned nodes;
+    unsigned tables;
+    unsigned live;
     int i;
     int j;
     int k;
+#endif
     int result;
 
     new_as = as_create();
@@ -240,71 +611,106 @@ int as_copy(struct addrspace *old_as, struct addrspace **ret) {
     }
 
     // Copy regions.
-    r_prv = old_as->regions; // Old head of regions linked list.
-    while (r_prv != NULL) {
+    for (idx = 0; idx < regionarray_num(&old_as->regions); idx++) {
 
         // Make copy of old region.
-        r_cur = copy_region(r_prv);
-        if (r_cur == NULL) {
+        r = copy_region(regionarray_get(&old_as->regions, idx));
+        if (r == NULL) {
             result = ENOMEM;
             goto cleanupB;
         }
 
         // Add copied region to new address space.
-        add_region(new_as, r_cur); // Use this function because we're lazy and want to be safe.
+        result = add_region(new_as, r);
+        if (result != 0) {
+            free_region(r);
+            goto cleanupB;
+        }
 
-        // Next region to copy.
-        r_prv = r_prv->next;
+        if (regionarray_get(&old_as->regions, idx) == old_as->as_heap) {
+            new_as->as_heap = r;
+        }
+        if (regionarray_get(&old_as->regions, idx) == old_as->as_stack) {
+            new_as->as_stack = r;
+        }
     }
+    new_as->as_heapend = old_as->as_heapend;
+
+    // Share the page table's frames copy-on-write rather than copying them.
+#if OPT_HPT
+    pos = 0;
+    while ((old_pte = hpt_next(old_as, &pos, &vaddr)) != NULL) {
+        result = hpt_insert(new_as, vaddr, &new_pte);
+        if (result != 0) {
+            goto cleanupB;
+        }
 
-    // Copy page table
-    for (i = 0; i < PG_SIZE_0; i++) {
-        if (old_as->pgtable[i] != NULL) {
-            for (j = 0; j < PG_SIZE_1; j++) {
-                if (old_as->pgtable[i][j] != NULL) {
-                    for (k = 0; k < PG_SIZE_2; k++) {
-                        if (old_as->pgtable[i][j][k] != 0) {
-
-                            // Get paddr from old page table.
-                            paddr = old_as->pgtable[i][j][k];
-
-                            // Get region permissions for paddr.
-                            perm = GET_WRITE_BIT(paddr) | GET_READ_BIT(paddr);
-
-                            // Malloc required page table entry.
-                            result = vm_allocpte1(new_as, paddr);
-                            if (result != 0) {
-                                goto cleanupB;
-                            }
-
-                            result = vm_allocpte2(new_as, paddr);
-                            if (result != 0) {
-                                goto cleanupC;
-                            }
-
-                            result = vm_allocpte3(new_as, paddr, perm);
-                            if (result != 0) {
-                                goto cleanupD;
-                            }
-                        }
-                    }
+        result = copy_pte(old_as, old_pte, new_as, new_pte, vaddr);
+        if (result != 0) {
+            goto cleanupB;
+        }
+    }
+#else
+    // Empty tables are skipped and each scan stops once it has found every
+    // live entry. Entries can only be cleared meanwhile, by page outs, so the
+    // counts read up front are never too low.
+    nodes = old_as->as_pgnodes;
+    for (i = 0; i < PG_SIZE_0 && nodes > 0; i++) {
+        old_node = old_as->pgtable[i];
+        if (old_node == NULL) {
+            continue;
+        }
+        nodes--;
+
+        tables = old_node->pn_tables;
+        for (j = 0; j < PG_SIZE_1 && tables > 0; j++) {
+            if (old_node->pn_table[j] == NULL) {
+                continue;
+            }
+            tables--;
+
+            live = old_node->pn_live[j];
+            if (live == 0) {
+                continue;
+            }
+
+            if (new_as->pgtable[i] == NULL) {
+                result = vm_allocpte1(new_as, PG_KEY(i, 0, 0));
+                if (result != 0) {
+                    goto cleanupB;
+                }
+            }
+
+            result = vm_allocpte2(new_as, PG_KEY(i, j, 0));
+            if (result != 0) {
+                goto cleanupB;
+            }
+
+            for (k = 0; k < PG_SIZE_2 && live > 0; k++) {
+                if (old_node->pn_table[j][k] == 0) {
+                    continue;
+                }
+                live--;
+
+                result = copy_pte(old_as, &old_node->pn_table[j][k],
+                                  new_as, &new_as->pgtable[i]->pn_table[j][k],
+                                  PG_KEY_TO_VADDR(PG_KEY(i, j, k)));
+                if (result != 0) {
+                    goto cleanupB;
                 }
             }
         }
     }
+#endif
+
+    // The old address space is the current one and may still have writeable
+    // translations for pages that are now copy-on-write.
+    vm_asidflush(old_as);
 
     *ret = new_as; // Return the pointer to the copied address space.
     result = 0;
     goto cleanupA;
 
-cleanupD:
-    kfree(new_as->pgtable[i][j]);
-    old_as->pgtable[i][j] = NULL;
-
-cleanupC:
-    kfree(new_as->pgtable[i]);
-    old_as->pgtable[i] = NULL;
-
 cleanupB:
     as_destroy(new_as);
 
@@ -313,33 +719,67 @@ cleanupA:
 }
 
 void as_destroy(struct addrspace *as) {
+    struct region *r;
+    unsigned idx;
+#if OPT_HPT
+    paddr_t *pte;
+    vaddr_t vaddr;
+    unsigned pos;
+#else
+    struct pgnode *node;
     int i;
     int j;
-    int k;
+#endif
+
+    // Mappings are written back to their files before the pages go. There
+    // is no one left to report a failure to.
+    for (idx = 0; idx < regionarray_num(&as->regions); idx++) {
+        r = regionarray_get(&as->regions, idx);
+        if (r->mapped) {
+            sync_region(as, r);
+        }
+    }
 
     // Free regions
     free_regions(as);
+    regionarray_cleanup(&as->regions);
+
+    // Make sure the TLB refill handler no longer walks the page table.
+    vm_asiddeactivate(as);
 
     // Free page table
-    for (i = 0; i < PG_SIZE_0; i++) {
-        if (as->pgtable[i] != NULL) {
-            for (j = 0; j < PG_SIZE_1; j++) {
-                if (as->pgtable[i][j] != NULL) {
-                    for (k = 0; k < PG_SIZE_2; k++) {
-                        if (as->pgtable[i][j][k] != 0) {
-                            free_kpages(PADDR_TO_KVADDR(as->pgtable[i][j][k] & PAGE_FRAME));
-                        }
-                    }
-                }
-                kfree(as->pgtable[i][j]);
-                as->pgtable[i][j] = NULL;
+#if OPT_HPT
+    pos = 0;
+    while ((pte = hpt_next(as, &pos, &vaddr)) != NULL) {
+        free_pte(as, pte, vaddr);
+        hpt_remove(as, vaddr);
+    }
+#else
+    // Only allocated nodes and tables are visited, and the counts say when
+    // the last one has been seen.
+    for (i = 0; i < PG_SIZE_0 && as->as_pgnodes > 0; i++) {
+        node = as->pgtable[i];
+        if (node == NULL) {
+            continue;
+        }
+
+        for (j = 0; j < PG_SIZE_1 && node->pn_tables > 0; j++) {
+            if (node->pn_table[j] == NULL) {
+                continue;
             }
-            kfree(as->pgtable[i]);
-            as->pgtable[i] = NULL;
+
+            free_table(as, node, i, j);
+            vm_freepte2(as, PG_KEY(i, j, 0));
         }
+
+        vm_freepte1(as, PG_KEY(i, 0, 0));
     }
     kfree(as->pgtable);
     as->pgtable = NULL;
+#endif
+
+    wchan_destroy(as->as_wchan);
+    spinlock_cleanup(&as->as_lock);
 
     // Free address space
     kfree(as);
@@ -358,11 +798,15 @@ void as_activate(void) {
         return;
     }
 
-    vm_tlbflush();
+    // TLB entries are tagged with the ASID, so there is nothing to flush.
+    vm_asidactivate(as);
 }
 
 void as_deactivate(void) {
-    vm_tlbflush();
+    // Entries of a deactivated address space are never matched by another
+    // one, and its ASID is not reused until the TLB is flushed. Only the
+    // fast refill path has to forget it.
+    vm_asiddeactivate(NULL);
 }
 
 /*
@@ -384,22 +828,23 @@ int as_define_region(struct addrspace *as,
 
     struct region *r;
     int cur_perm;
+    int result;
 
     // Check if address space is valid.
     if (as == NULL) {
         return EFAULT;
     }
 
-    // Check if given vaddr and memsize is invalid.
-    if (search_region(as, vaddr, memsize) != NULL) {
-        return ENOMEM;
-    }
-
     // Align region
     memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
     vaddr &= PAGE_FRAME;
     memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
 
+    // Check if given vaddr and memsize is invalid.
+    if (overlap_region(as, vaddr, memsize)) {
+        return ENOMEM;
+    }
+
     // Initialise the region.
     cur_perm = readable | writeable | executable;
     r = init_region(vaddr, memsize, cur_perm, cur_perm);
@@ -407,27 +852,31 @@ int as_define_region(struct addrspace *as,
         return ENOMEM;
     }
 
-    // Add region to the linked list.
-    add_region(as, r);
+    // Add region to the sorted regions.
+    result = add_region(as, r);
+    if (result != 0) {
+        free_region(r);
+        return result;
+    }
 
     return 0;
 }
 
 int as_prepare_load(struct addrspace *as) {
     struct region *r;
+    unsigned idx;
     int perm;
 
-    r = as->regions;
-    if (r == NULL) {
+    if (regionarray_num(&as->regions) == 0) {
         return EFAULT;
     }
     
     perm = R_RD | R_WR | R_EX;
 
-    while (r != NULL) {
+    for (idx = 0; idx < regionarray_num(&as->regions); idx++) {
+        r = regionarray_get(&as->regions, idx);
         r->old_perm = r->cur_perm;
         r->cur_perm = perm;
-        r = r->next;
     }
 
     return 0;
@@ -435,21 +884,47 @@ int as_prepare_load(struct addrspace *as) {
 
 int as_complete_load(struct addrspace *as) {
     struct region *r;
-    int spl;
+    unsigned idx;
+    int result;
 
-    r = as->regions;
-    if (r == NULL) {
+    if (regionarray_num(&as->regions) == 0) {
         return EFAULT;
     }
 
-    while (r != NULL) {
+    for (idx = 0; idx < regionarray_num(&as->regions); idx++) {
+        r = regionarray_get(&as->regions, idx);
         r->cur_perm = r->old_perm;
-        r = r->next;
+
+        // Read-only segments of the executable share their frames with
+        // every other process running it. Without memory for the cache
+        // entry the region just pages in privately.
+        if (r->vn != NULL && !r->mapped && r->text == NULL &&
+            (r->cur_perm & R_WR) == 0) {
+            r->text = textfile_get(r->vn, r->file_offset, r->file_vaddr,
+                                   r->file_size);
+        }
     }
 
-    spl = splhigh();
-    vm_tlbflush();
-    splx(spl);
+    // Drop translations made with the load time permissions.
+    vm_asidflush(as);
+
+    // Start an empty heap just past the last segment.
+    if (as->as_heap == NULL) {
+        r = regionarray_get(&as->regions, regionarray_num(&as->regions) - 1);
+        r = init_region(r->vaddr + r->memsize, 0, R_RD | R_WR, R_RD | R_WR);
+        if (r == NULL) {
+            return ENOMEM;
+        }
+
+        result = add_region(as, r);
+        if (result != 0) {
+            free_region(r);
+            return result;
+        }
+
+        as->as_heap = r;
+        as->as_heapend = r->vaddr;
+    }
 
     return 0;
 }
@@ -457,12 +932,14 @@ int as_complete_load(struct addrspace *as) {
 int as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
     int result;
     
-    // A stack is a region.
+    // A stack is a region. It starts small and grows on demand.
     result = as_define_region(as, USERSTACK - USERSTACKSIZE, USERSTACKSIZE,
         R_RD, R_WR, 0);
     if (result != 0) {
         return result;
     }
+    as->as_stack = search_region(as, USERSTACK - USERSTACKSIZE, 0);
+    KASSERT(as->as_stack != NULL);
 
     // Initial user-level stack pointer.
     *stackptr = USERSTACK;
@@ -470,3 +947,255 @@ int as_define_stack(struct addrspace *as, vaddr_t *stackptr) {
     return 0;
 }
 
+struct region *as_growstack(struct addrspace *as, vaddr_t vaddr) {
+    struct region *stack;
+    struct region *below;
+    vaddr_t base;
+    unsigned idx;
+
+    stack = as->as_stack;
+    if (stack == NULL || vaddr >= stack->vaddr ||
+        stack->vaddr - vaddr > USERSTACKREACH ||
+        vaddr < USERSTACK - USERSTACKMAX) {
+        return NULL;
+    }
+    base = vaddr & PAGE_FRAME;
+
+    // Keep the guard gap above the region below the stack, normally the heap.
+    idx = find_region(as, stack->vaddr - 1);
+    if (idx > 0) {
+        below = regionarray_get(&as->regions, idx - 1);
+        if (below->vaddr + below->memsize + USERSTACKGUARD > base) {
+            return NULL;
+        }
+    }
+
+    // Regions stay sorted since nothing lies between base and the stack.
+    stack->memsize += stack->vaddr - base;
+    stack->vaddr = base;
+
+    return stack;
+}
+
+/**
+ * Backs the region containing vaddr with filesize bytes of the vnode starting
+ * at offset. Nothing is read here; vm_fault() reads each page the first time
+ * it is touched and zero-fills whatever lies past the file data.
+ */
+int as_define_file(struct addrspace *as,
+                   struct vnode *v,
+                   off_t offset,
+                   vaddr_t vaddr,
+                   size_t filesize) {
+    struct region *r;
+
+    r = search_region(as, vaddr, filesize);
+    if (r == NULL) {
+        return EFAULT;
+    }
+
+    // A region is backed by at most one file mapping.
+    if (r->vn != NULL) {
+        return EINVAL;
+    }
+
+    VOP_INCREF(v);
+    r->vn = v;
+    r->file_offset = offset;
+    r->file_vaddr = vaddr;
+    r->file_size = filesize;
+
+    return 0;
+}
+
+/**
+ * Moves the break of the heap by amount bytes and returns the old break.
+ *
+ * Growing only extends the heap region; its pages are zero-filled by
+ * vm_fault() when first touched. Shrinking frees the pages that drop out of
+ * the region straight away.
+ */
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak) {
+    struct region *heap;
+    vaddr_t newbreak;
+    vaddr_t oldtop;
+    vaddr_t newtop;
+
+    heap = as->as_heap;
+    if (heap == NULL) {
+        return ENOMEM;
+    }
+
+    // Break may not go below the start of the heap or wrap around.
+    if (amount < 0 && -(vaddr_t)amount > as->as_heapend - heap->vaddr) {
+        return EINVAL;
+    }
+    if (amount > 0 && (vaddr_t)amount > USERSPACETOP - as->as_heapend) {
+        return ENOMEM;
+    }
+
+    newbreak = as->as_heapend + amount;
+    oldtop = heap->vaddr + heap->memsize;
+    newtop = ROUNDUP(newbreak, PAGE_SIZE);
+
+    // Heap may not grow into the region above it, nor into the range the
+    // stack may still grow down into or the guard gap below that.
+    if (newtop > oldtop && (overlap_region(as, oldtop, newtop - oldtop) ||
+        (as->as_stack != NULL &&
+         newtop > USERSTACK - USERSTACKMAX - USERSTACKGUARD))) {
+        return ENOMEM;
+    }
+
+    heap->memsize = newtop - heap->vaddr;
+    *oldbreak = as->as_heapend;
+    as->as_heapend = newbreak;
+
+    if (newtop < oldtop) {
+        free_pages(as, newtop, oldtop);
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the highest address below the regions where memsize bytes fit
+ * between two regions, or 0 if there is no such gap. Mappings go just below
+ * the stack's growth limit and guard gap, leaving the space above the heap for
+ * the heap to grow into.
+ */
+static vaddr_t find_gap(struct addrspace *as, size_t memsize) {
+    struct region *r;
+    vaddr_t top;
+    vaddr_t bottom;
+    unsigned idx;
+
+    top = USERSPACETOP;
+    for (idx = regionarray_num(&as->regions); idx > 0; idx--) {
+        r = regionarray_get(&as->regions, idx - 1);
+        bottom = r->vaddr + r->memsize;
+        if (top >= bottom && top - bottom >= memsize) {
+            return top - memsize;
+        }
+        top = r->vaddr;
+
+        // Leave the stack room to grow, and its guard gap.
+        if (r == as->as_stack &&
+            top > USERSTACK - USERSTACKMAX - USERSTACKGUARD) {
+            top = USERSTACK - USERSTACKMAX - USERSTACKGUARD;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Maps length bytes of the file v starting at offset into a new region with
+ * the given permissions. Nothing is read here; vm_fault() reads each page the
+ * first time it is touched. Pages past the end of the file read as zeroes and
+ * are never written back.
+ */
+int as_mmap(struct addrspace *as, size_t length, int perm,
+            struct vnode *v, off_t offset, vaddr_t *ret) {
+    struct region *r;
+    struct stat st;
+    size_t memsize;
+    vaddr_t vaddr;
+    int result;
+
+    if (length == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+        return EINVAL;
+    }
+    if (length > USERSPACETOP) {
+        return ENOMEM;
+    }
+    memsize = ROUNDUP(length, PAGE_SIZE);
+
+    result = VOP_STAT(v, &st);
+    if (result != 0) {
+        return result;
+    }
+
+    vaddr = find_gap(as, memsize);
+    if (vaddr == 0) {
+        return ENOMEM;
+    }
+
+    r = init_region(vaddr, memsize, perm, perm);
+    if (r == NULL) {
+        return ENOMEM;
+    }
+
+    VOP_INCREF(v);
+    r->vn = v;
+    r->file_offset = offset;
+    r->file_vaddr = vaddr;
+    r->file_size = 0;
+    if (st.st_size > offset) {
+        r->file_size = st.st_size - offset < (off_t)length ?
+            st.st_size - offset : length;
+    }
+    r->mapped = 1;
+
+    result = add_region(as, r);
+    if (result != 0) {
+        free_region(r);
+        return result;
+    }
+
+    *ret = vaddr;
+    return 0;
+}
+
+/**
+ * Removes the mapping starting at vaddr, after writing its modified pages
+ * back to the file. If the write back fails the mapping is left in place.
+ */
+int as_munmap(struct addrspace *as, vaddr_t vaddr) {
+    struct region *r;
+    size_t memsize;
+    unsigned idx;
+    int result;
+
+    idx = find_region(as, vaddr);
+    if (idx == 0) {
+        return EINVAL;
+    }
+
+    r = regionarray_get(&as->regions, idx - 1);
+    if (r->vaddr != vaddr || !r->mapped) {
+        return EINVAL;
+    }
+
+    result = sync_region(as, r);
+    if (result != 0) {
+        return result;
+    }
+
+    // Once the region is gone its pages can no longer be faulted in.
+    memsize = r->memsize;
+    remove_region(as, r);
+    free_pages(as, vaddr, vaddr + memsize);
+
+    return 0;
+}
+
+/**
+ * Writes the modified pages of every mapping of the file v back to it.
+ */
+int as_syncfile(struct addrspace *as, struct vnode *v) {
+    struct region *r;
+    unsigned idx;
+    int result;
+
+    for (idx = 0; idx < regionarray_num(&as->regions); idx++) {
+        r = regionarray_get(&as->regions, idx);
+        if (r->mapped && r->vn == v) {
+            result = sync_region(as, r);
+            if (result != 0) {
+                return result;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <hpt.h>
+
+/**
+ * An entry in the hashed page table. Entries with the same hash are chained
+ * through he_next, an index into the same flat array. Free entries are
+ * chained the same way on the free list.
+ */
+struct hpt_entry {
+    struct addrspace *he_as; // Owning address space, NULL if free.
+    vaddr_t he_vaddr;        // Page aligned virtual address.
+    paddr_t he_pte;          // Page table entry, protected by as_lock.
+    unsigned he_next;        // Next entry in the chain.
+};
+
+// End of a chain.
+#define HPT_NONE ((unsigned)-1)
+
+// Hash of an address space and virtual page. Address spaces are kmalloc'd so
+// the low bits of their addresses carry little information.
+#define HPT_HASH(as, vaddr) \
+    (((((uint32_t)(as) >> 4) * 2654435761U) ^ ((vaddr) >> 12)) % hpt_size)
+
+static struct hpt_entry *hpt = NULL;  // All entries.
+static unsigned *hpt_chains = NULL;   // First entry of each hash chain.
+static unsigned hpt_size = 0;         // Number of entries and of chains.
+static unsigned hpt_free = HPT_NONE;  // First free entry.
+
+// Protects the chains and the free list but not the entries themselves.
+static struct spinlock hpt_spinlock = SPINLOCK_INITIALIZER;
+
+/**
+ * Allocates the table with HPT_ENTRIES_PER_FRAME entries per physical frame,
+ * all on the free list.
+ */
+void hpt_bootstrap(void) {
+    unsigned i;
+
+    hpt_size = ram_getsize() / PAGE_SIZE * HPT_ENTRIES_PER_FRAME;
+
+    hpt = kmalloc(hpt_size * sizeof(struct hpt_entry));
+    hpt_chains = kmalloc(hpt_size * sizeof(unsigned));
+    if (hpt == NULL || hpt_chains == NULL) {
+        panic("hpt: cannot allocate %u entries\n", hpt_size);
+    }
+
+    for (i = 0; i < hpt_size; i++) {
+        hpt[i].he_as = NULL;
+        hpt[i].he_vaddr = 0;
+        hpt[i].he_pte = 0;
+        hpt[i].he_next = (i + 1 < hpt_size) ? i + 1 : HPT_NONE;
+        hpt_chains[i] = HPT_NONE;
+    }
+    hpt_free = 0;
+
+    kprintf("hpt: %u page table entries\n", hpt_size);
+}
+
+/**
+ * Returns the link (chain head or previous entry's he_next) pointing at the
+ * entry for vaddr in as, or at HPT_NONE if there is no such entry. Call with
+ * hpt_spinlock held.
+ */
+static unsigned *hpt_find(struct addrspace *as, vaddr_t vaddr) {
+    unsigned *link;
+
+    KASSERT(spinlock_do_i_hold(&hpt_spinlock));
+
+    link = &hpt_chains[HPT_HASH(as, vaddr)];
+    while (*link != HPT_NONE) {
+        if (hpt[*link].he_as == as && hpt[*link].he_vaddr == vaddr) {
+            break;
+        }
+        link = &hpt[*link].he_next;
+    }
+
+    return link;
+}
+
+/**
+ * Unlinks the entry link points at and puts it on the free list. Call with
+ * hpt_spinlock held.
+ */
+static void hpt_unlink(unsigned *link) {
+    unsigned idx;
+
+    KASSERT(spinlock_do_i_hold(&hpt_spinlock));
+
+    idx = *link;
+    KASSERT(hpt[idx].he_pte == 0);
+
+    *link = hpt[idx].he_next;
+    hpt[idx].he_as = NULL;
+    hpt[idx].he_next = hpt_free;
+    hpt_free = idx;
+}
+
+/**
+ * Frees the zero entries of an address space, which are left behind by clean
+ * pages being dropped. Only the thread working on as may call this, since it
+ * is the only one holding pointers to such entries. Call with hpt_spinlock
+ * held.
+ */
+static void hpt_purge(struct addrspace *as) {
+    unsigned *link;
+    unsigned i;
+
+    for (i = 0; i < hpt_size; i++) {
+        link = &hpt_chains[i];
+        while (*link != HPT_NONE) {
+            if (hpt[*link].he_as == as && hpt[*link].he_pte == 0) {
+                hpt_unlink(link);
+            } else {
+                link = &hpt[*link].he_next;
+            }
+        }
+    }
+}
+
+paddr_t *hpt_lookup(struct addrspace *as, vaddr_t vaddr) {
+    unsigned idx;
+
+    vaddr &= PAGE_FRAME;
+
+    spinlock_acquire(&hpt_spinlock);
+    idx = *hpt_find(as, vaddr);
+    spinlock_release(&hpt_spinlock);
+
+    return idx == HPT_NONE ? NULL : &hpt[idx].he_pte;
+}
+
+/**
+ * Returns the entry for vaddr in as through ret, adding a zero entry if there
+ * is none yet. When the table is full, the zero entries of as are reclaimed
+ * before giving up with ENOMEM.
+ */
+int hpt_insert(struct addrspace *as, vaddr_t vaddr, paddr_t **ret) {
+    unsigned *link;
+    unsigned idx;
+
+    vaddr &= PAGE_FRAME;
+
+    spinlock_acquire(&hpt_spinlock);
+
+    link = hpt_find(as, vaddr);
+    if (*link != HPT_NONE) {
+        *ret = &hpt[*link].he_pte;
+        spinlock_release(&hpt_spinlock);
+        return 0;
+    }
+
+    if (hpt_free == HPT_NONE) {
+        hpt_purge(as);
+        if (hpt_free == HPT_NONE) {
+            spinlock_release(&hpt_spinlock);
+            return ENOMEM;
+        }
+    }
+
+    // Take a free entry and put it at the head of its chain.
+    idx = hpt_free;
+    hpt_free = hpt[idx].he_next;
+    hpt[idx].he_as = as;
+    hpt[idx].he_vaddr = vaddr;
+    hpt[idx].he_pte = 0;
+    hpt[idx].he_next = hpt_chains[HPT_HASH(as, vaddr)];
+    hpt_chains[HPT_HASH(as, vaddr)] = idx;
+
+    spinlock_release(&hpt_spinlock);
+
+    *ret = &hpt[idx].he_pte;
+    return 0;
+}
+
+void hpt_remove(struct addrspace *as, vaddr_t vaddr) {
+    unsigned *link;
+
+    vaddr &= PAGE_FRAME;
+
+    spinlock_acquire(&hpt_spinlock);
+    link = hpt_find(as, vaddr);
+    if (*link != HPT_NONE) {
+        hpt_unlink(link);
+    }
+    spinlock_release(&hpt_spinlock);
+}
+
+/**
+ * Returns the next entry of as at or after index *pos and its virtual
+ * address, or NULL when there are no more. Entries added or removed during
+ * the walk may or may not be seen.
+ */
+paddr_t *hpt_next(struct addrspace *as, unsigned *pos, vaddr_t *vaddr) {
+    unsigned i;
+
+    spinlock_acquire(&hpt_spinlock);
+    for (i = *pos; i < hpt_size; i++) {
+        if (hpt[i].he_as == as) {
+            *pos = i + 1;
+            *vaddr = hpt[i].he_vaddr;
+            spinlock_release(&hpt_spinlock);
+            return &hpt[i].he_pte;
+        }
+    }
+    *pos = hpt_size;
+    spinlock_release(&hpt_spinlock);
+
+    return NULL;
+}
@@ -0,0 +1,359 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <ptcache.h>
+
+#define PTCACHE_MAX 4        // Caches that can be created.
+#define PTCACHE_CPU_SIZE 16  // Objects a CPU's free list can hold.
+#define PTCACHE_CPU_BATCH 8  // Objects moved per refill or drain.
+
+/**
+ * A frame carved into objects. The header sits at the start of the frame and
+ * the objects fill the rest of it, so an object's slab is found by rounding
+ * its address down to the frame. Free objects are linked through their first
+ * word.
+ */
+struct ptslab {
+    struct ptslab *ps_next;  // Next slab with free objects.
+    struct ptslab *ps_prev;  // Previous slab with free objects.
+    void *ps_free;           // Free objects.
+    unsigned ps_inuse;       // Objects handed out, including CPU free lists.
+};
+
+/**
+ * Free objects kept by one CPU. Only that CPU uses it, so its lock is never
+ * contended; it just keeps the list consistent against interrupts.
+ */
+struct ptcache_cpu {
+    struct spinlock pcc_lock;
+    void *pcc_free;          // Free objects, linked through their first word.
+    unsigned pcc_count;      // Number of objects on pcc_free.
+    unsigned pcc_hits;       // Allocations and frees handled locally.
+};
+
+struct ptcache {
+    const char *pc_name;
+    size_t pc_size;              // Object size.
+    unsigned pc_perslab;         // Objects per frame.
+    struct spinlock pc_lock;     // Protects the slabs and counts below.
+    struct ptslab *pc_partial;   // Slabs with free objects.
+    unsigned pc_slabs;           // Frames carved up.
+    unsigned pc_empty;           // Slabs with no objects handed out.
+    unsigned pc_inuse;           // Objects handed out.
+    struct ptcache_cpu pc_cpu[VM_CPUS];  // Free lists; other CPUs use the slabs.
+};
+
+static struct ptcache *ptcaches[PTCACHE_MAX];
+static unsigned ptcache_count = 0;
+static struct spinlock ptcache_spinlock = SPINLOCK_INITIALIZER;
+
+/**
+ * Returns the free list of the current CPU, or NULL if it has none.
+ */
+static struct ptcache_cpu *ptcache_cpu(struct ptcache *pc) {
+    if (!CURCPU_EXISTS() || curcpu->c_number >= VM_CPUS) {
+        return NULL;
+    }
+    return &pc->pc_cpu[curcpu->c_number];
+}
+
+static void slab_link(struct ptcache *pc, struct ptslab *ps) {
+    ps->ps_prev = NULL;
+    ps->ps_next = pc->pc_partial;
+    if (pc->pc_partial != NULL) {
+        pc->pc_partial->ps_prev = ps;
+    }
+    pc->pc_partial = ps;
+}
+
+static void slab_unlink(struct ptcache *pc, struct ptslab *ps) {
+    if (ps->ps_prev != NULL) {
+        ps->ps_prev->ps_next = ps->ps_next;
+    } else {
+        pc->pc_partial = ps->ps_next;
+    }
+    if (ps->ps_next != NULL) {
+        ps->ps_next->ps_prev = ps->ps_prev;
+    }
+    ps->ps_next = ps->ps_prev = NULL;
+}
+
+/**
+ * Takes a free object from the slabs, or returns NULL if they are all full.
+ * The object's free list link is left for the caller to clear. Call with
+ * pc_lock held.
+ */
+static void *slab_take(struct ptcache *pc) {
+    struct ptslab *ps;
+    void *obj;
+
+    KASSERT(spinlock_do_i_hold(&pc->pc_lock));
+
+    ps = pc->pc_partial;
+    if (ps == NULL) {
+        return NULL;
+    }
+
+    obj = ps->ps_free;
+    ps->ps_free = *(void **)obj;
+    if (ps->ps_inuse == 0) {
+        pc->pc_empty--;
+    }
+    ps->ps_inuse++;
+    pc->pc_inuse++;
+
+    if (ps->ps_free == NULL) {
+        slab_unlink(pc, ps);
+    }
+
+    return obj;
+}
+
+/**
+ * Puts a zeroed object back into its slab. One empty slab is kept to absorb
+ * the next allocation; the frame of any other slab that empties is handed
+ * back for the caller to free once it has dropped its locks, otherwise 0 is
+ * returned. Call with pc_lock held.
+ */
+static vaddr_t slab_put(struct ptcache *pc, void *obj) {
+    struct ptslab *ps;
+
+    KASSERT(spinlock_do_i_hold(&pc->pc_lock));
+
+    ps = (struct ptslab *)((vaddr_t)obj & PAGE_FRAME);
+    KASSERT(ps->ps_inuse > 0);
+
+    if (ps->ps_free == NULL) {
+        slab_link(pc, ps);
+    }
+    *(void **)obj = ps->ps_free;
+    ps->ps_free = obj;
+    ps->ps_inuse--;
+    pc->pc_inuse--;
+
+    if (ps->ps_inuse > 0) {
+        return 0;
+    }
+    if (pc->pc_empty == 0) {
+        pc->pc_empty++;
+        return 0;
+    }
+
+    slab_unlink(pc, ps);
+    pc->pc_slabs--;
+    return (vaddr_t)ps;
+}
+
+/**
+ * Carves a new frame into zeroed objects. The frame is allocated with no locks
+ * held since that may page something out.
+ */
+static int ptcache_grow(struct ptcache *pc) {
+    struct ptslab *ps;
+    vaddr_t frame;
+    vaddr_t obj;
+    unsigned i;
+
+    frame = alloc_kpages(1);
+    if (frame == 0) {
+        return ENOMEM;
+    }
+    bzero((void *)frame, PAGE_SIZE);
+
+    ps = (struct ptslab *)frame;
+    obj = frame + PAGE_SIZE - pc->pc_perslab * pc->pc_size;
+    for (i = 0; i < pc->pc_perslab; i++) {
+        *(void **)obj = ps->ps_free;
+        ps->ps_free = (void *)obj;
+        obj += pc->pc_size;
+    }
+
+    spinlock_acquire(&pc->pc_lock);
+    slab_link(pc, ps);
+    pc->pc_slabs++;
+    pc->pc_empty++;
+    spinlock_release(&pc->pc_lock);
+
+    return 0;
+}
+
+/**
+ * Moves up to PTCACHE_CPU_BATCH objects from the slabs onto a CPU's free list.
+ * Call with the list locked.
+ */
+static void ptcache_refill(struct ptcache *pc, struct ptcache_cpu *pcc) {
+    void *obj;
+    unsigned n;
+
+    spinlock_acquire(&pc->pc_lock);
+    for (n = 0; n < PTCACHE_CPU_BATCH; n++) {
+        obj = slab_take(pc);
+        if (obj == NULL) {
+            break;
+        }
+        *(void **)obj = pcc->pcc_free;
+        pcc->pcc_free = obj;
+        pcc->pcc_count++;
+    }
+    spinlock_release(&pc->pc_lock);
+}
+
+/**
+ * Moves PTCACHE_CPU_BATCH objects from a CPU's free list back into the slabs,
+ * handing back the frames of slabs that empty. Call with the list locked.
+ */
+static unsigned ptcache_drain(struct ptcache *pc, struct ptcache_cpu *pcc,
+                              vaddr_t *frames) {
+    unsigned nframes;
+    unsigned n;
+    void *obj;
+
+    nframes = 0;
+    spinlock_acquire(&pc->pc_lock);
+    for (n = 0; n < PTCACHE_CPU_BATCH && pcc->pcc_count > 0; n++) {
+        obj = pcc->pcc_free;
+        pcc->pcc_free = *(void **)obj;
+        pcc->pcc_count--;
+
+        frames[nframes] = slab_put(pc, obj);
+        if (frames[nframes] != 0) {
+            nframes++;
+        }
+    }
+    spinlock_release(&pc->pc_lock);
+
+    return nframes;
+}
+
+struct ptcache *ptcache_create(const char *name, size_t size) {
+    struct ptcache *pc;
+    unsigned i;
+
+    KASSERT(size >= sizeof(void *) && size % sizeof(void *) == 0);
+    KASSERT(size <= PAGE_SIZE - sizeof(struct ptslab));
+
+    pc = kmalloc(sizeof(*pc));
+    if (pc == NULL) {
+        return NULL;
+    }
+
+    pc->pc_name = name;
+    pc->pc_size = size;
+    pc->pc_perslab = (PAGE_SIZE - sizeof(struct ptslab)) / size;
+    spinlock_init(&pc->pc_lock);
+    pc->pc_partial = NULL;
+    pc->pc_slabs = 0;
+    pc->pc_empty = 0;
+    pc->pc_inuse = 0;
+    for (i = 0; i < VM_CPUS; i++) {
+        spinlock_init(&pc->pc_cpu[i].pcc_lock);
+        pc->pc_cpu[i].pcc_free = NULL;
+        pc->pc_cpu[i].pcc_count = 0;
+        pc->pc_cpu[i].pcc_hits = 0;
+    }
+
+    spinlock_acquire(&ptcache_spinlock);
+    KASSERT(ptcache_count < PTCACHE_MAX);
+    ptcaches[ptcache_count++] = pc;
+    spinlock_release(&ptcache_spinlock);
+
+    return pc;
+}
+
+void *ptcache_alloc(struct ptcache *pc) {
+    struct ptcache_cpu *pcc;
+    void *obj;
+
+    pcc = ptcache_cpu(pc);
+
+    while (1) {
+        if (pcc != NULL) {
+            spinlock_acquire(&pcc->pcc_lock);
+            if (pcc->pcc_count == 0) {
+                ptcache_refill(pc, pcc);
+            } else {
+                pcc->pcc_hits++;
+            }
+            obj = pcc->pcc_free;
+            if (obj != NULL) {
+                pcc->pcc_free = *(void **)obj;
+                pcc->pcc_count--;
+            }
+            spinlock_release(&pcc->pcc_lock);
+        } else {
+            spinlock_acquire(&pc->pc_lock);
+            obj = slab_take(pc);
+            spinlock_release(&pc->pc_lock);
+        }
+
+        if (obj != NULL) {
+            // The rest of the object is still zero from when it was freed.
+            *(void **)obj = NULL;
+            return obj;
+        }
+
+        if (ptcache_grow(pc) != 0) {
+            return NULL;
+        }
+    }
+}
+
+void ptcache_free(struct ptcache *pc, void *obj) {
+    struct ptcache_cpu *pcc;
+    vaddr_t frames[PTCACHE_CPU_BATCH];
+    unsigned nframes;
+    unsigned i;
+
+    KASSERT(obj != NULL);
+    bzero(obj, pc->pc_size);
+
+    nframes = 0;
+    pcc = ptcache_cpu(pc);
+    if (pcc != NULL) {
+        spinlock_acquire(&pcc->pcc_lock);
+        if (pcc->pcc_count == PTCACHE_CPU_SIZE) {
+            nframes = ptcache_drain(pc, pcc, frames);
+        } else {
+            pcc->pcc_hits++;
+        }
+        *(void **)obj = pcc->pcc_free;
+        pcc->pcc_free = obj;
+        pcc->pcc_count++;
+        spinlock_release(&pcc->pcc_lock);
+    } else {
+        spinlock_acquire(&pc->pc_lock);
+        frames[0] = slab_put(pc, obj);
+        spinlock_release(&pc->pc_lock);
+        nframes = frames[0] != 0;
+    }
+
+    for (i = 0; i < nframes; i++) {
+        free_kpages(frames[i]);
+    }
+}
+
+void ptcache_printstats(void) {
+    struct ptcache *pc;
+    unsigned i, j;
+
+    for (i = 0; i < ptcache_count; i++) {
+        pc = ptcaches[i];
+
+        spinlock_acquire(&pc->pc_lock);
+        kprintf("ptcache %s: %u-byte objects, %u in use, %u slabs of %u, "
+                "%u empty\n", pc->pc_name, (unsigned)pc->pc_size, pc->pc_inuse,
+                pc->pc_slabs, pc->pc_perslab, pc->pc_empty);
+        spinlock_release(&pc->pc_lock);
+
+        for (j = 0; j < VM_CPUS; j++) {
+            if (pc->pc_cpu[j].pcc_hits > 0) {
+                kprintf("    cpu%u: %u free, %u local\n", j,
+                        pc->pc_cpu[j].pcc_count, pc->pc_cpu[j].pcc_hits);
+            }
+        }
+    }
+}
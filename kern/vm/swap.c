@@ -0,0 +1,241 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <clock.h>
+#include <vm.h>
+#include <vmstat.h>
+#include <swap.h>
+
+static struct vnode *swap_vnode = NULL;  // Swap device, NULL if no swap.
+static struct bitmap *swap_map = NULL;   // Allocated swap slots.
+static unsigned swap_nslots = 0;         // Number of slots on the device.
+static unsigned swap_hint = 0;           // Where the next slot search starts.
+
+unsigned swap_cluster = SWAP_CLUSTER_DEFAULT;
+
+static struct spinlock swap_spinlock = SPINLOCK_INITIALIZER;
+
+/**
+ * Opens the swap device and sizes the slot bitmap to it.
+ *
+ * Running without swap is not an error; the system just cannot page out and
+ * allocations fail once physical memory is exhausted.
+ */
+void swap_bootstrap(void) {
+    struct stat st;
+    char path[sizeof(SWAP_DEVICE)];
+    int result;
+
+    // vfs_open() mangles its path argument.
+    strcpy(path, SWAP_DEVICE);
+
+    result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+    if (result != 0) {
+        kprintf("swap: %s: %s, paging disabled\n", SWAP_DEVICE,
+                strerror(result));
+        swap_vnode = NULL;
+        return;
+    }
+
+    result = VOP_STAT(swap_vnode, &st);
+    if (result != 0) {
+        goto fail;
+    }
+
+    swap_nslots = st.st_size / PAGE_SIZE;
+    if (swap_nslots == 0) {
+        result = ENOSPC;
+        goto fail;
+    }
+
+    swap_map = bitmap_create(swap_nslots);
+    if (swap_map == NULL) {
+        result = ENOMEM;
+        goto fail;
+    }
+
+    kprintf("swap: %uk swap space on %s\n", swap_nslots * PAGE_SIZE / 1024,
+            SWAP_DEVICE);
+    return;
+
+fail:
+    kprintf("swap: %s: %s, paging disabled\n", SWAP_DEVICE, strerror(result));
+    vfs_close(swap_vnode);
+    swap_vnode = NULL;
+    swap_nslots = 0;
+}
+
+/**
+ * Transfers the frames at kvaddrs to or from npages consecutive swap slots
+ * starting at slot, as a single request to the device, so a cluster costs one
+ * seek rather than one per page. The time taken is counted so that swap
+ * throughput can be worked out from the counters.
+ */
+static int swap_io(unsigned slot, const vaddr_t *kvaddrs, unsigned npages,
+                   enum uio_rw rw) {
+    struct iovec iov[SWAP_CLUSTER_MAX];
+    struct uio u;
+    struct timespec before;
+    struct timespec after;
+    unsigned i;
+    int result;
+
+    KASSERT(npages > 0 && npages <= SWAP_CLUSTER_MAX);
+    KASSERT(slot + npages <= swap_nslots);
+
+    for (i = 0; i < npages; i++) {
+        iov[i].iov_kbase = (void *)kvaddrs[i];
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    u.uio_iov = iov;
+    u.uio_iovcnt = npages;
+    u.uio_offset = (off_t)slot * PAGE_SIZE;
+    u.uio_resid = npages * PAGE_SIZE;
+    u.uio_segflg = UIO_SYSSPACE;
+    u.uio_rw = rw;
+    u.uio_space = NULL;
+
+    gettime(&before);
+    if (rw == UIO_READ) {
+        result = VOP_READ(swap_vnode, &u);
+        vmstat_inc(VMSTAT_SWAP_READS);
+    } else {
+        result = VOP_WRITE(swap_vnode, &u);
+        vmstat_inc(VMSTAT_SWAP_WRITES);
+    }
+    gettime(&after);
+    timespec_sub(&after, &before, &after);
+    vmstat_add(VMSTAT_SWAP_USECS,
+               after.tv_sec * 1000000 + after.tv_nsec / 1000);
+
+    if (result != 0) {
+        return result;
+    }
+
+    if (u.uio_resid != 0) {
+        return EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * Allocates a run of up to max free consecutive slots, searching on from
+ * where the last run ended. Returns the length of the run, which starts at
+ * the first free slot found, or 0 if swap is full.
+ */
+static unsigned swap_allocrun(unsigned max, unsigned *first) {
+    unsigned slot;
+    unsigned run;
+    unsigned n;
+
+    spinlock_acquire(&swap_spinlock);
+
+    for (n = 0; n < swap_nslots; n++) {
+        slot = (swap_hint + n) % swap_nslots;
+        if (!bitmap_isset(swap_map, slot)) {
+            break;
+        }
+    }
+    if (n == swap_nslots) {
+        spinlock_release(&swap_spinlock);
+        return 0;
+    }
+
+    for (run = 0; run < max && slot + run < swap_nslots; run++) {
+        if (bitmap_isset(swap_map, slot + run)) {
+            break;
+        }
+        bitmap_mark(swap_map, slot + run);
+    }
+    swap_hint = (slot + run) % swap_nslots;
+
+    spinlock_release(&swap_spinlock);
+
+    *first = slot;
+    return run;
+}
+
+/**
+ * Allocates swap slots for npages frames and writes the frames out to them,
+ * slots[i] receiving kvaddrs[i]. Frames go to consecutive slots as far as
+ * free space allows, each run of slots written with one request.
+ *
+ * Either every frame is written or none is. Returns ENOSPC if there is no
+ * swap or not enough of it free.
+ */
+int swap_out_cluster(const vaddr_t *kvaddrs, unsigned npages, unsigned *slots) {
+    unsigned done;
+    unsigned first;
+    unsigned run;
+    unsigned i;
+    int result;
+
+    if (swap_vnode == NULL) {
+        return ENOSPC;
+    }
+
+    for (done = 0; done < npages; done += run) {
+        run = swap_allocrun(npages - done, &first);
+        if (run == 0) {
+            result = ENOSPC;
+            goto fail;
+        }
+
+        for (i = 0; i < run; i++) {
+            slots[done + i] = first + i;
+        }
+
+        result = swap_io(first, kvaddrs + done, run, UIO_WRITE);
+        if (result != 0) {
+            done += run;
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    for (i = 0; i < done; i++) {
+        swap_free(slots[i]);
+    }
+    return result;
+}
+
+/**
+ * Allocates a swap slot and writes the frame at kvaddr out to it.
+ */
+int swap_out(vaddr_t kvaddr, unsigned *slot) {
+    return swap_out_cluster(&kvaddr, 1, slot);
+}
+
+/**
+ * Reads npages consecutive slots starting at slot into the frames at kvaddrs
+ * with one request. The slots stay allocated.
+ */
+int swap_in_cluster(unsigned slot, const vaddr_t *kvaddrs, unsigned npages) {
+    KASSERT(swap_vnode != NULL);
+
+    return swap_io(slot, kvaddrs, npages, UIO_READ);
+}
+
+/**
+ * Reads a swap slot into the frame at kvaddr. The slot stays allocated.
+ */
+int swap_in(unsigned slot, vaddr_t kvaddr) {
+    return swap_in_cluster(slot, &kvaddr, 1);
+}
+
+void swap_free(unsigned slot) {
+    spinlock_acquire(&swap_spinlock);
+    KASSERT(bitmap_isset(swap_map, slot));
+    bitmap_unmark(swap_map, slot);
+    spinlock_release(&swap_spinlock);
+}
@@ -0,0 +1,298 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <vm.h>
+#include <textcache.h>
+
+/**
+ * A read-only segment of an executable and the frames read in for it. The
+ * frames are indexed by page, starting from the page holding the first byte of
+ * file data; only pages with file data in them are cached, the rest of the
+ * segment is zero-filled.
+ */
+struct textfile {
+    struct textfile *tf_next;  // Next segment in the cache.
+    struct vnode *tf_vn;       // Executable, referenced by the cache.
+    off_t tf_offset;           // File offset of the data at tf_vaddr.
+    vaddr_t tf_vaddr;          // Virtual address the file data starts at.
+    size_t tf_filesize;        // Number of bytes backed by the file.
+    unsigned tf_refs;          // Regions referencing the segment.
+    unsigned tf_npages;        // Entries in tf_frames.
+    unsigned tf_cached;        // Entries in tf_frames that are set.
+    vaddr_t *tf_frames;        // Cached frames, 0 if not read in.
+};
+
+// Protects the list, the frames of every textfile and the counts below. Taken
+// before frame_table_spinlock.
+static struct spinlock textcache_spinlock = SPINLOCK_INITIALIZER;
+static struct textfile *textfiles = NULL;
+
+static unsigned textcache_hits = 0;    // Faults mapping a cached frame.
+static unsigned textcache_reads = 0;   // Frames read in and cached.
+static unsigned textcache_races = 0;   // Frames read in twice for one page.
+static unsigned textcache_shrunk = 0;  // Frames freed for lack of memory.
+
+/**
+ * Returns the index in tf_frames of the page at vaddr.
+ */
+static unsigned textfile_page(struct textfile *tf, vaddr_t vaddr) {
+    unsigned idx;
+
+    idx = ((vaddr & PAGE_FRAME) - (tf->tf_vaddr & PAGE_FRAME)) / PAGE_SIZE;
+    KASSERT(idx < tf->tf_npages);
+
+    return idx;
+}
+
+/**
+ * Returns the cached segment matching the arguments, or NULL. Call with
+ * textcache_spinlock held.
+ */
+static struct textfile *textfile_find(struct vnode *vn, off_t offset,
+                                      vaddr_t vaddr, size_t filesize) {
+    struct textfile *tf;
+
+    KASSERT(spinlock_do_i_hold(&textcache_spinlock));
+
+    for (tf = textfiles; tf != NULL; tf = tf->tf_next) {
+        if (tf->tf_vn == vn && tf->tf_offset == offset &&
+            tf->tf_vaddr == vaddr && tf->tf_filesize == filesize) {
+            return tf;
+        }
+    }
+
+    return NULL;
+}
+
+struct textfile *textfile_get(struct vnode *vn, off_t offset, vaddr_t vaddr,
+                              size_t filesize) {
+    struct textfile *tf;
+    struct textfile *found;
+    unsigned npages;
+
+    // A segment with no file data is all zero-fill, there is nothing to share.
+    npages = (((vaddr + filesize + PAGE_SIZE - 1) & PAGE_FRAME) -
+              (vaddr & PAGE_FRAME)) / PAGE_SIZE;
+    if (npages == 0) {
+        return NULL;
+    }
+
+    spinlock_acquire(&textcache_spinlock);
+    found = textfile_find(vn, offset, vaddr, filesize);
+    if (found != NULL) {
+        found->tf_refs++;
+    }
+    spinlock_release(&textcache_spinlock);
+    if (found != NULL) {
+        return found;
+    }
+
+    // Allocated unlocked since kmalloc may page something out.
+    tf = kmalloc(sizeof(*tf));
+    if (tf == NULL) {
+        return NULL;
+    }
+    tf->tf_frames = kmalloc(npages * sizeof(vaddr_t));
+    if (tf->tf_frames == NULL) {
+        kfree(tf);
+        return NULL;
+    }
+    bzero(tf->tf_frames, npages * sizeof(vaddr_t));
+
+    tf->tf_vn = vn;
+    tf->tf_offset = offset;
+    tf->tf_vaddr = vaddr;
+    tf->tf_filesize = filesize;
+    tf->tf_refs = 1;
+    tf->tf_npages = npages;
+    tf->tf_cached = 0;
+
+    // Another process may have started the same executable meanwhile.
+    spinlock_acquire(&textcache_spinlock);
+    found = textfile_find(vn, offset, vaddr, filesize);
+    if (found != NULL) {
+        found->tf_refs++;
+    } else {
+        VOP_INCREF(vn);
+        tf->tf_next = textfiles;
+        textfiles = tf;
+    }
+    spinlock_release(&textcache_spinlock);
+
+    if (found != NULL) {
+        kfree(tf->tf_frames);
+        kfree(tf);
+        return found;
+    }
+
+    return tf;
+}
+
+void textfile_incref(struct textfile *tf) {
+    spinlock_acquire(&textcache_spinlock);
+    KASSERT(tf->tf_refs > 0);
+    tf->tf_refs++;
+    spinlock_release(&textcache_spinlock);
+}
+
+void textfile_put(struct textfile *tf) {
+    struct textfile **prev;
+    unsigned count;
+    unsigned i;
+
+    spinlock_acquire(&textcache_spinlock);
+    KASSERT(tf->tf_refs > 0);
+    tf->tf_refs--;
+    if (tf->tf_refs > 0) {
+        spinlock_release(&textcache_spinlock);
+        return;
+    }
+
+    for (prev = &textfiles; *prev != tf; prev = &(*prev)->tf_next) {
+        KASSERT(*prev != NULL);
+    }
+    *prev = tf->tf_next;
+    spinlock_release(&textcache_spinlock);
+
+    // Frames still mapped by an exiting process just lose the cache's
+    // reference and go with the last mapping.
+    count = 0;
+    for (i = 0; i < tf->tf_npages; i++) {
+        if (tf->tf_frames[i] != 0) {
+            tf->tf_frames[count++] = tf->tf_frames[i];
+        }
+    }
+    KASSERT(count == tf->tf_cached);
+    free_kpages_batch(tf->tf_frames, count);
+
+    VOP_DECREF(tf->tf_vn);
+    kfree(tf->tf_frames);
+    kfree(tf);
+}
+
+/**
+ * Maps the cached frame kvaddr at vaddr in as. Called with a reference to the
+ * frame taken under textcache_spinlock, which keeps it from being shrunk
+ * meanwhile and is dropped here. Recording the mapping may allocate memory,
+ * so it is done unlocked. Returns whether the frame was mapped.
+ */
+static int textfile_map(vaddr_t kvaddr, struct addrspace *as, vaddr_t vaddr) {
+    int result;
+
+    // Cached frames are never pinned, so this only fails for lack of memory.
+    result = share_upage(kvaddr, as, vaddr);
+    free_kpages(kvaddr);
+
+    return result == 0;
+}
+
+vaddr_t textfile_lookup(struct textfile *tf, struct addrspace *as,
+                        vaddr_t vaddr) {
+    vaddr_t kvaddr;
+    unsigned idx;
+
+    idx = textfile_page(tf, vaddr);
+
+    spinlock_acquire(&textcache_spinlock);
+    kvaddr = tf->tf_frames[idx];
+    if (kvaddr != 0) {
+        if (share_kpages(kvaddr) != 0) {
+            panic("textcache: cached frame 0x%x is busy\n", kvaddr);
+        }
+        textcache_hits++;
+    }
+    spinlock_release(&textcache_spinlock);
+
+    // Without the memory to map the cached frame the caller reads its own.
+    if (kvaddr != 0 && !textfile_map(kvaddr, as, vaddr)) {
+        return 0;
+    }
+
+    return kvaddr;
+}
+
+vaddr_t textfile_insert(struct textfile *tf, struct addrspace *as,
+                        vaddr_t vaddr, vaddr_t kvaddr) {
+    vaddr_t cached;
+    unsigned idx;
+
+    idx = textfile_page(tf, vaddr);
+
+    spinlock_acquire(&textcache_spinlock);
+    cached = tf->tf_frames[idx];
+    if (cached == 0) {
+        // The cache's reference; the frame is no longer anyone's to evict.
+        if (share_kpages(kvaddr) == 0) {
+            tf->tf_frames[idx] = kvaddr;
+            tf->tf_cached++;
+            textcache_reads++;
+        }
+        spinlock_release(&textcache_spinlock);
+        return kvaddr;
+    }
+
+    if (share_kpages(cached) != 0) {
+        panic("textcache: cached frame 0x%x is busy\n", cached);
+    }
+    textcache_races++;
+    spinlock_release(&textcache_spinlock);
+
+    if (!textfile_map(cached, as, vaddr)) {
+        return kvaddr;
+    }
+    free_upage(kvaddr, as, vaddr);
+    return cached;
+}
+
+unsigned textcache_shrink(void) {
+    struct textfile *tf;
+    unsigned freed;
+    unsigned i;
+
+    // A frame only the cache refers to cannot gain a mapping while the lock
+    // is held, since every new mapping comes from textfile_lookup().
+    freed = 0;
+    spinlock_acquire(&textcache_spinlock);
+    for (tf = textfiles; tf != NULL; tf = tf->tf_next) {
+        for (i = 0; i < tf->tf_npages && tf->tf_cached > 0; i++) {
+            if (tf->tf_frames[i] == 0 ||
+                kpages_refcount(tf->tf_frames[i]) != 1) {
+                continue;
+            }
+            free_kpages(tf->tf_frames[i]);
+            tf->tf_frames[i] = 0;
+            tf->tf_cached--;
+            freed++;
+        }
+    }
+    textcache_shrunk += freed;
+    spinlock_release(&textcache_spinlock);
+
+    return freed;
+}
+
+void textcache_printstats(void) {
+    struct textfile *tf;
+    unsigned files;
+    unsigned refs;
+    unsigned cached;
+
+    files = 0;
+    refs = 0;
+    cached = 0;
+
+    spinlock_acquire(&textcache_spinlock);
+    for (tf = textfiles; tf != NULL; tf = tf->tf_next) {
+        files++;
+        refs += tf->tf_refs;
+        cached += tf->tf_cached;
+    }
+    kprintf("textcache: %u segments, %u regions, %u frames cached\n",
+            files, refs, cached);
+    kprintf("textcache: %u hits, %u reads, %u races, %u shrunk\n",
+            textcache_hits, textcache_reads, textcache_races,
+            textcache_shrunk);
+    spinlock_release(&textcache_spinlock);
+}
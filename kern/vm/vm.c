@@ -9,117 +9,1330 @@
 #include <vm.h>
 #include <spl.h>
 #include <current.h>
+#include <cpu.h>
+#include <clock.h>
+#include <uio.h>
+#include <vnode.h>
+#include <wchan.h>
+#include <swap.h>
+#include <hpt.h>
+#include <ptcache.h>
+#include <vmstat.h>
+#include <textcache.h>
+
+// Number of address space IDs, the size of the EntryHi PID field.
+#define ASID_COUNT ((TLBHI_PID >> TLBHI_PIDSHIFT) + 1)
+#define ASID_TO_TLBHI(asid) ((asid) << TLBHI_PIDSHIFT)
+
+// A TLB context is an ASID together with the generation it was handed out in:
+// generation * ASID_COUNT + ASID. Generations start at 1, so 0 is no context.
+#define CONTEXT_GEN(ctx) ((ctx) / ASID_COUNT)
+#define CONTEXT_ASID(ctx) ((ctx) % ASID_COUNT)
+
+/**
+ * TLB state of one CPU. Each CPU has its own TLB and hands out its own ASIDs,
+ * so this is only written by its own CPU, with interrupts off. Other CPUs
+ * read tc_generation and tc_as to tell whether an address space can still
+ * have entries here; tc_as is only set with the address space's as_lock held.
+ *
+ * A new translation replaces the entry already mapping its page if there is
+ * one, then goes to a slot known to be invalid, and otherwise replaces slots
+ * in round-robin order, using the hand in vm_utlbcpu that the fast refill
+ * handler advances as well. Invalidated slots are remembered in tc_holes; the
+ * fast path may have filled them since, so each one is checked before use.
+ */
+struct tlbcpu {
+    uint32_t tc_generation;       // ASID generation being handed out.
+    uint32_t tc_asidnext;         // Next free ASID in the generation.
+    uint32_t tc_context;          // Context loaded in EntryHi.
+    struct addrspace *tc_as;      // Address space last activated.
+    uint8_t tc_holes[NUM_TLB];    // Slots invalidated since the last flush.
+    unsigned tc_nholes;
+
+    // Statistics
+    unsigned tc_loads;            // Translations loaded by vm_fault.
+    unsigned tc_updates;          // Loads that replaced an entry for the page.
+    unsigned tc_fills;            // Loads into an invalid slot.
+    unsigned tc_evictions;        // Loads that evicted another valid entry.
+    unsigned tc_shootdowns;       // Shootdowns handled for other CPUs.
+
+    // Fault-around, see vm_faultaround().
+    unsigned tc_window;           // Pages to map ahead of the next fault.
+    unsigned tc_aroundfaults;     // Faults that mapped pages ahead.
+    unsigned tc_aroundloads;      // Pages mapped ahead.
+};
+
+static struct tlbcpu tlb_cpu[VM_CPUS];
+
+// Shared with the fast TLB refill handler in exception-mips1.S. A NULL
+// uc_table sends every TLB miss to vm_fault().
+struct vm_utlbcpu vm_utlbcpu[VM_CPUS];
+
+// Largest fault-around window, 0 turns fault-around off.
+unsigned vm_faultaround_max = FAULTAROUND_DEFAULT;
+
+// Protects the tb_pending masks of batches in flight and the shootdown
+// statistics.
+static struct spinlock tlb_shootdown_lock = SPINLOCK_INITIALIZER;
+
+// Shootdown statistics
+static unsigned tlb_shootdowns;    // Batches sent to other CPUs.
+static unsigned tlb_shootipis;     // CPUs interrupted.
+static unsigned tlb_shootpages;    // Pages in the batches sent.
+static unsigned tlb_shootspaces;   // Batches that dropped a whole space.
+static unsigned tlb_shootresends;  // Sends retried on a full queue.
+static uint64_t tlb_shootns;       // Time spent waiting for other CPUs.
+static uint32_t tlb_shootmaxns;    // Longest wait.
+
+// Frame of zeroes mapped read-only by every untouched anonymous page that has
+// only been read so far. Allocated once at boot and never freed or evicted.
+vaddr_t vm_zeropage = 0;
+
+#if !OPT_HPT
+// Caches the page table nodes and tables are allocated from. Their objects
+// come already zeroed.
+static struct ptcache *vm_nodecache = NULL;
+static struct ptcache *vm_tablecache = NULL;
 
 int vm_allocpte1(struct addrspace *as, paddr_t paddr) {
     int idx0;
-    int i;
 
     // Get page table index.
     idx0 = PG_IDX0(paddr);
 
-    // Malloc 1st level page table entry.
-    as->pgtable[idx0] = (paddr_t **)kmalloc(PG_SIZE_1 * sizeof(paddr_t));
-    if (as->pgtable[idx0] == 0) {
+    // Allocate an empty 1st level page table node.
+    as->pgtable[idx0] = ptcache_alloc(vm_nodecache);
+    if (as->pgtable[idx0] == NULL) {
         return ENOMEM;
     }
-
-    // Initialise 1st level page table entry.
-    memset(as->pgtable[idx0], 0, PG_SIZE_1 * sizeof(paddr_t));
-
-    // Zero-fill 2nd level page table entry.
-    for (i = 0; i < PG_SIZE_1; i++) {
-        as->pgtable[idx0][i] = NULL;
-    }
+    as->as_pgnodes++;
 
     return 0;
 }
 
 int vm_allocpte2(struct addrspace *as, paddr_t paddr) {
-    int idx0;
+    struct pgnode *node;
     int idx1;
-    int i;
 
-    // Get page table index.
-    idx0 = PG_IDX0(paddr);
+    // Get page table node and index.
+    node = as->pgtable[PG_IDX0(paddr)];
     idx1 = PG_IDX1(paddr);
 
-    // Malloc 2nd level page table entry.
-    as->pgtable[idx0][idx1] = (paddr_t *)kmalloc(PG_SIZE_2 * sizeof(paddr_t));
-    if (as->pgtable[idx0][idx1] == 0) {
+    // Allocate a 2nd level page table of zero 3rd level entries.
+    node->pn_table[idx1] = ptcache_alloc(vm_tablecache);
+    if (node->pn_table[idx1] == NULL) {
         return ENOMEM;
     }
+    node->pn_live[idx1] = 0;
+    node->pn_tables++;
+
+    return 0;
+}
+
+/**
+ * Frees the 1st level page table node for paddr, which must have no 2nd level
+ * tables left.
+ */
+void vm_freepte1(struct addrspace *as, paddr_t paddr) {
+    struct pgnode *node;
+
+    node = as->pgtable[PG_IDX0(paddr)];
+    KASSERT(node->pn_tables == 0);
 
-    // Initialise 2nd level page table entry.
-    memset(as->pgtable[idx0][idx1], 0, PG_SIZE_2 * sizeof(paddr_t));
+    as->pgtable[PG_IDX0(paddr)] = NULL;
+    as->as_pgnodes--;
+    ptcache_free(vm_nodecache, node);
+}
+
+/**
+ * Frees the 2nd level page table for paddr, whose entries must all be zero.
+ */
+void vm_freepte2(struct addrspace *as, paddr_t paddr) {
+    struct pgnode *node;
+    paddr_t *table;
 
-    // Zero-fill 3rd level page table entry.
-    for (i = 0; i < PG_SIZE_2; i++) {
-        as->pgtable[idx0][idx1][i] = 0;
+    node = as->pgtable[PG_IDX0(paddr)];
+    table = node->pn_table[PG_IDX1(paddr)];
+    KASSERT(node->pn_live[PG_IDX1(paddr)] == 0);
+
+    node->pn_table[PG_IDX1(paddr)] = NULL;
+    node->pn_tables--;
+    ptcache_free(vm_tablecache, table);
+}
+#endif
+
+/**
+ * Keeps the live entry count of the 2nd level page table holding the entry
+ * for vaddr up to date; delta is 1 when the entry becomes non-zero and -1 when
+ * it is cleared. Changes are made with as->as_lock held, like the entries
+ * themselves. The hashed page table needs no counts.
+ */
+void vm_ptecount(struct addrspace *as, vaddr_t vaddr, int delta) {
+#if OPT_HPT
+    (void)as;
+    (void)vaddr;
+    (void)delta;
+#else
+    struct pgnode *node;
+    paddr_t paddr;
+
+    paddr = KVADDR_TO_PADDR(vaddr);
+    node = as->pgtable[PG_IDX0(paddr)];
+    KASSERT(node != NULL && node->pn_table[PG_IDX1(paddr)] != NULL);
+    KASSERT(delta > 0 ? node->pn_live[PG_IDX1(paddr)] < PG_SIZE_2 :
+            node->pn_live[PG_IDX1(paddr)] > 0);
+    node->pn_live[PG_IDX1(paddr)] += delta;
+#endif
+}
+
+/**
+ * Returns a pointer to the 3rd level page table entry for vaddr, or NULL if
+ * the page table levels leading to it have not been allocated. With the
+ * hashed page table, NULL means the page has no entry yet.
+ */
+static paddr_t *vm_lookuppte(struct addrspace *as, vaddr_t vaddr) {
+#if OPT_HPT
+    return hpt_lookup(as, vaddr);
+#else
+    paddr_t paddr;
+
+    paddr = KVADDR_TO_PADDR(vaddr);
+
+    if (as->pgtable[PG_IDX0(paddr)] == NULL ||
+        as->pgtable[PG_IDX0(paddr)]->pn_table[PG_IDX1(paddr)] == NULL) {
+        return NULL;
     }
 
-    return 0;
+    return &as->pgtable[PG_IDX0(paddr)]->pn_table[PG_IDX1(paddr)][PG_IDX2(paddr)];
+#endif
 }
 
+/**
+ * Allocates a zero-filled frame for the page and installs it in the 3rd level
+ * page table entry. The frame normally comes already zeroed from the zero
+ * pool.
+ *
+ * The frame is left pinned so it cannot be paged out before the caller has
+ * finished filling it; the caller must unpin_upage() it.
+ */
 int vm_allocpte3(struct addrspace *as, paddr_t paddr, int perm) {
     vaddr_t vaddr;
     paddr_t pfn;   // Page frame number.
-    int idx0;
-    int idx1;
-    int idx2;
+    paddr_t *pte;
 
-    // Get page table index.
-    idx0 = PG_IDX0(paddr);
-    idx1 = PG_IDX1(paddr);
-    idx2 = PG_IDX2(paddr);
+    // Page table entry must already exist.
+    pte = vm_lookuppte(as, PG_KEY_TO_VADDR(paddr));
+    KASSERT(pte != NULL);
 
-    // Allocate frame/physical address.
-    vaddr = alloc_kpages(1);
+    // Allocate frame/physical address, paging something out if need be.
+    vaddr = alloc_zeroed_upage(as, PG_KEY_TO_VADDR(paddr));
     if (vaddr == 0) {
         return ENOMEM;
     }
     
     // Get page frame number.
     pfn = KVADDR_TO_PADDR(vaddr);
-    
-    // Zero-fill 3rd level page table entry.
-    bzero((void *)PADDR_TO_KVADDR(pfn), PAGE_SIZE);
 
     // Assign 3rd level page table entry.
-    as->pgtable[idx0][idx1][idx2] = (pfn & PAGE_FRAME) | GET_DIRTY_BIT(perm) |
-        GET_VALID_BIT(perm);
+    spinlock_acquire(&as->as_lock);
+    *pte = (pfn & PAGE_FRAME) | GET_DIRTY_BIT(perm) | GET_VALID_BIT(perm) |
+        PTE_REFERENCED;
+    vm_ptecount(as, PG_KEY_TO_VADDR(paddr), 1);
+    spinlock_release(&as->as_lock);
+
+    return 0;
+}
+
+/**
+ * Maps the page at pte to the shared zero page. Pages of writeable regions
+ * are mapped copy-on-write, so the first write gives them a frame of their own.
+ */
+static int vm_mapzero(struct addrspace *as, paddr_t *pte, vaddr_t vaddr,
+                      int perm) {
+    int result;
+
+    // Each mapping holds a reference, like any other shared frame.
+    result = share_kpages(vm_zeropage);
+    if (result != 0) {
+        return result;
+    }
+
+    spinlock_acquire(&as->as_lock);
+    *pte = KVADDR_TO_PADDR(vm_zeropage) | GET_VALID_BIT(perm) |
+        (((perm & R_WR) == R_WR) * PTE_COW) | PTE_REFERENCED;
+    vm_ptecount(as, vaddr, 1);
+    spinlock_release(&as->as_lock);
+
+    return 0;
+}
+
+/**
+ * Waits for a page that is being written out to swap to finish paging out,
+ * and returns its page table entry. Call with as->as_lock held.
+ */
+static paddr_t vm_waitpte(struct addrspace *as, paddr_t *pte) {
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+    while ((*pte & PTE_PAGING) != 0) {
+        wchan_sleep(as->as_wchan, &as->as_lock);
+    }
+
+    return *pte;
+}
+
+/**
+ * Returns the TLB state of the current CPU. Call with interrupts off so the
+ * thread cannot move to another CPU.
+ */
+static struct tlbcpu *vm_tlbcpu(void) {
+    KASSERT(curcpu->c_number < VM_CPUS);
+    return &tlb_cpu[curcpu->c_number];
+}
+
+/**
+ * Returns the context of as on the current CPU if it is from the current
+ * generation, so its entries may be in the TLB, otherwise 0. Call with
+ * interrupts off.
+ */
+static uint32_t vm_asidcontext(struct tlbcpu *tc, struct addrspace *as) {
+    uint32_t context;
+
+    context = as->as_context[curcpu->c_number];
+    return CONTEXT_GEN(context) == tc->tc_generation ? context : 0;
+}
+
+/**
+ * Gives as a new ASID on the current CPU. When the ASIDs run out a new
+ * generation is started: the whole TLB is flushed, which leaves every other
+ * address space's ASID on this CPU stale, so each one gets a new ASID the next
+ * time it is activated here. Call with interrupts off.
+ */
+static void vm_asidassign(struct tlbcpu *tc, struct addrspace *as) {
+    if (tc->tc_asidnext == ASID_COUNT) {
+        tc->tc_generation++;
+        tc->tc_asidnext = 0;
+        vm_tlbflush();
+    }
+
+    as->as_context[curcpu->c_number] =
+        tc->tc_generation * ASID_COUNT + tc->tc_asidnext++;
+}
+
+/**
+ * Makes as the address space matched by TLB lookups on this CPU, first giving
+ * it an ASID if it has none from the current generation here.
+ */
+void vm_asidactivate(struct addrspace *as) {
+    struct tlbcpu *tc;
+
+    // Also keeps the thread on this CPU.
+    spinlock_acquire(&as->as_lock);
+
+    tc = vm_tlbcpu();
+    if (vm_asidcontext(tc, as) == 0) {
+        vm_asidassign(tc, as);
+    }
+
+    tc->tc_context = as->as_context[curcpu->c_number];
+    tc->tc_as = as;
+    tlb_setpid(ASID_TO_TLBHI(CONTEXT_ASID(tc->tc_context)));
+#if !OPT_HPT
+    vm_utlbcpu[curcpu->c_number].uc_table = as->pgtable;
+#endif
+    as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+
+    spinlock_release(&as->as_lock);
+}
+
+/**
+ * Clears the CPUs that can no longer hold entries of as from as_cpus, so
+ * that shootdowns stop going to them: those where its ASID has been retired,
+ * or is from an older generation, and that are running something else. An
+ * address space that is not current on a CPU only gets entries there again by
+ * being activated, which sets its bit again. Call with as->as_lock held.
+ */
+static void vm_asidprune(struct addrspace *as) {
+    uint32_t context;
+    unsigned i;
+
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+    for (i = 0; i < VM_CPUS; i++) {
+        if ((as->as_cpus & ((uint32_t)1 << i)) == 0 ||
+            tlb_cpu[i].tc_as == as) {
+            continue;
+        }
+        // A stale read of the generation only keeps the bit set.
+        context = as->as_context[i];
+        if (context == 0 || CONTEXT_GEN(context) != tlb_cpu[i].tc_generation) {
+            as->as_cpus &= ~((uint32_t)1 << i);
+        }
+    }
+}
+
+/**
+ * Stops the fast TLB refill path walking the page table of as, which is
+ * being destroyed, on any CPU. NULL means whatever address space is current
+ * on this CPU, which is being deactivated.
+ */
+void vm_asiddeactivate(struct addrspace *as) {
+#if OPT_HPT
+    (void)as;
+#else
+    unsigned i;
+    int spl;
+
+    spl = splhigh();
+    if (as == NULL) {
+        vm_utlbcpu[curcpu->c_number].uc_table = NULL;
+    } else {
+        // No CPU runs as any more, so none of them can be switching to it.
+        for (i = 0; i < VM_CPUS; i++) {
+            if (vm_utlbcpu[i].uc_table == as->pgtable) {
+                vm_utlbcpu[i].uc_table = NULL;
+            }
+        }
+    }
+    splx(spl);
+#endif
+}
+
+/**
+ * Drops every TLB entry of as, on every CPU. Must be called with no spinlocks
+ * held, see vm_tlbbatch_flush().
+ */
+void vm_asidflush(struct addrspace *as) {
+    struct tlbbatch tb;
+
+    vm_tlbbatch_init(&tb, as);
+    tb.tb_npages = TLBSHOOTDOWN_PAGES + 1;
+    vm_tlbbatch_flush(&tb);
+}
+
+/**
+ * Removes the TLB entry for vaddr tagged with the given ASID, if any, and
+ * remembers its slot as free. Leaves EntryHi for the caller to restore. Call
+ * with interrupts off.
+ */
+static void vm_tlbdrop(struct tlbcpu *tc, uint32_t asid, vaddr_t vaddr) {
+    int idx;
+
+    idx = tlb_probe((vaddr & PAGE_FRAME) | ASID_TO_TLBHI(asid), 0);
+    if (idx >= 0) {
+        tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+        if (tc->tc_nholes < NUM_TLB) {
+            tc->tc_holes[tc->tc_nholes++] = idx;
+        }
+    }
+}
+
+/**
+ * Removes any TLB entry for vaddr in the given address space from this CPU's
+ * TLB. Other CPUs are left alone; see vm_tlbbatch_flush() for those.
+ *
+ * Entries are tagged with the ASID, so this works for address spaces other
+ * than the current one as long as their ASID is not stale.
+ */
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr) {
+    struct tlbcpu *tc;
+    uint32_t context;
+    int spl;
+
+    spl = splhigh();
+
+    tc = vm_tlbcpu();
+    context = vm_asidcontext(tc, as);
+    if (context != 0) {
+        vm_tlbdrop(tc, CONTEXT_ASID(context), vaddr);
+        tlb_setpid(ASID_TO_TLBHI(CONTEXT_ASID(tc->tc_context)));
+    }
+
+    splx(spl);
+}
+
+/**
+ * Drops the pages of a batch from this CPU's TLB. A whole address space is
+ * dropped by retiring its ASID here, as its entries are never matched again;
+ * if it is the current one it gets a new ASID straight away. Call with
+ * interrupts off.
+ */
+static void vm_tlbdropbatch(const struct tlbbatch *tb) {
+    struct tlbcpu *tc;
+    uint32_t context;
+    unsigned i;
+
+    tc = vm_tlbcpu();
+    context = vm_asidcontext(tc, tb->tb_as);
+    if (context == 0) {
+        return;
+    }
+
+    if (tb->tb_npages > TLBSHOOTDOWN_PAGES) {
+        // The current address space goes straight to its new ASID, so that
+        // vm_asidprune() never sees it without one.
+        if (context == tc->tc_context) {
+            vm_asidassign(tc, tb->tb_as);
+            tc->tc_context = tb->tb_as->as_context[curcpu->c_number];
+        } else {
+            tb->tb_as->as_context[curcpu->c_number] = 0;
+        }
+    } else {
+        for (i = 0; i < tb->tb_npages; i++) {
+            vm_tlbdrop(tc, CONTEXT_ASID(context), tb->tb_vaddr[i]);
+        }
+    }
+
+    tlb_setpid(ASID_TO_TLBHI(CONTEXT_ASID(tc->tc_context)));
+}
+
+/**
+ * Starts an empty batch of pages of as to drop from the TLBs.
+ */
+void vm_tlbbatch_init(struct tlbbatch *tb, struct addrspace *as) {
+    tb->tb_as = as;
+    tb->tb_npages = 0;
+    tb->tb_pending = 0;
+}
+
+/**
+ * Adds the page at vaddr to a batch. Past TLBSHOOTDOWN_PAGES pages the batch
+ * drops all of the address space's entries instead.
+ */
+void vm_tlbbatch_add(struct tlbbatch *tb, vaddr_t vaddr) {
+    if (tb->tb_npages < TLBSHOOTDOWN_PAGES) {
+        tb->tb_vaddr[tb->tb_npages] = vaddr & PAGE_FRAME;
+    }
+    if (tb->tb_npages <= TLBSHOOTDOWN_PAGES) {
+        tb->tb_npages++;
+    }
+}
+
+/**
+ * Drops the pages of a batch from the TLB of every CPU that may hold entries
+ * of the address space, and empties the batch. Call after changing the page
+ * table entries and before reusing the frames they mapped.
+ *
+ * This CPU's TLB is done directly. The others are sent the batch as one
+ * shootdown IPI, and the call only returns once they have all handled it.
+ * The wait is with interrupts on so that shootdowns sent to this CPU meanwhile
+ * are handled too; no spinlocks may be held, or a CPU spinning for one of them
+ * could never take the IPI.
+ *
+ * Waiting senders can be preempted, so any number of batches may be on their
+ * way to one CPU. A CPU whose shootdown queue is full is sent the batch again
+ * while waiting, once it has handled some. If the waiting thread has moved
+ * onto such a CPU meanwhile, it drops the batch there itself.
+ */
+void vm_tlbbatch_flush(struct tlbbatch *tb) {
+    struct tlbshootdown ts;
+    struct timespec before, after;
+    uint32_t cpus;
+    uint32_t unsent;
+    uint32_t self;
+    uint32_t ns;
+    unsigned i;
+    int spl;
+
+    KASSERT(curthread->t_iplhigh_count == 0);
+
+    if (tb->tb_npages == 0) {
+        return;
+    }
+
+    // Stay on this CPU until the shootdown is sent, so that the CPU doing its
+    // own TLB is never also waited for.
+    spl = splhigh();
+
+    vm_tlbdropbatch(tb);
+
+    spinlock_acquire(&tb->tb_as->as_lock);
+    vm_asidprune(tb->tb_as);
+    cpus = tb->tb_as->as_cpus & ~((uint32_t)1 << curcpu->c_number);
+    spinlock_release(&tb->tb_as->as_lock);
+
+    unsent = 0;
+    if (cpus != 0) {
+        spinlock_acquire(&tlb_shootdown_lock);
+        tb->tb_pending = cpus;
+        spinlock_release(&tlb_shootdown_lock);
+
+        gettime(&before);
+        ts.ts_batch = tb;
+        unsent = ipi_tlbshootdown_cpus(cpus, &ts);
+    }
+
+    splx(spl);
+
+    if (cpus == 0) {
+        tb->tb_npages = 0;
+        return;
+    }
+
+    while (1) {
+        if (unsent != 0) {
+            spl = splhigh();
+            self = (uint32_t)1 << curcpu->c_number;
+            if ((unsent & self) != 0) {
+                vm_tlbdropbatch(tb);
+                spinlock_acquire(&tlb_shootdown_lock);
+                tb->tb_pending &= ~self;
+                spinlock_release(&tlb_shootdown_lock);
+                unsent &= ~self;
+            }
+            unsent = ipi_tlbshootdown_cpus(unsent, &ts);
+            splx(spl);
+
+            spinlock_acquire(&tlb_shootdown_lock);
+            tlb_shootresends++;
+            spinlock_release(&tlb_shootdown_lock);
+        }
+
+        spinlock_acquire(&tlb_shootdown_lock);
+        if (tb->tb_pending == 0) {
+            break;
+        }
+        spinlock_release(&tlb_shootdown_lock);
+    }
+
+    gettime(&after);
+    timespec_sub(&after, &before, &after);
+    ns = after.tv_sec * 1000000000 + after.tv_nsec;
+
+    tlb_shootdowns++;
+    for (i = 0; i < VM_CPUS; i++) {
+        tlb_shootipis += (cpus >> i) & 1;
+    }
+    if (tb->tb_npages > TLBSHOOTDOWN_PAGES) {
+        tlb_shootspaces++;
+    } else {
+        tlb_shootpages += tb->tb_npages;
+    }
+    tlb_shootns += ns;
+    if (ns > tlb_shootmaxns) {
+        tlb_shootmaxns = ns;
+    }
+    spinlock_release(&tlb_shootdown_lock);
+
+    vmstat_inc(VMSTAT_TLB_SHOOTDOWNS);
+    tb->tb_npages = 0;
+}
+
+/**
+ * Picks the TLB slot for a new translation: an invalidated slot if one is
+ * still invalid, otherwise the next one in round-robin order. Call with
+ * interrupts off. Clobbers EntryHi, which the caller's tlb_write() sets again.
+ */
+static int vm_tlbvictim(struct tlbcpu *tc) {
+    struct vm_utlbcpu *uc;
+    uint32_t entry_hi;
+    uint32_t entry_lo;
+    int idx;
+
+    while (tc->tc_nholes > 0) {
+        idx = tc->tc_holes[--tc->tc_nholes];
+        tlb_read(&entry_hi, &entry_lo, idx);
+        if ((entry_lo & TLBLO_VALID) == 0) {
+            tc->tc_fills++;
+            return idx;
+        }
+    }
+
+    uc = &vm_utlbcpu[curcpu->c_number];
+    idx = uc->uc_next;
+    uc->uc_next = (uc->uc_next + 1) % NUM_TLB;
+
+    tlb_read(&entry_hi, &entry_lo, idx);
+    if ((entry_lo & TLBLO_VALID) != 0) {
+        tc->tc_evictions++;
+    } else {
+        tc->tc_fills++;
+    }
+
+    return idx;
+}
+
+/**
+ * Loads a translation for the current address space into this CPU's TLB. An
+ * entry that already maps the same page is updated in place, so the TLB never
+ * holds duplicate virtual pages; otherwise vm_tlbvictim() picks the slot.
+ */
+static void vm_tlbload(uint32_t entry_hi, uint32_t entry_lo) {
+    struct tlbcpu *tc;
+    int spl;
+    int idx;
+
+    spl = splhigh();
+    tc = vm_tlbcpu();
+    entry_hi |= ASID_TO_TLBHI(CONTEXT_ASID(tc->tc_context));
+    tc->tc_loads++;
+    idx = tlb_probe(entry_hi, 0);
+    if (idx >= 0) {
+        tc->tc_updates++;
+    } else {
+        idx = vm_tlbvictim(tc);
+    }
+    tlb_write(entry_hi, entry_lo, idx);
+    splx(spl);
+}
+
+/**
+ * Maps pages following a fault at vaddr into the TLB ahead of use, so that
+ * sequential access takes one trap per window instead of one per page.
+ *
+ * A fault on the page just past the last one mapped, by the fast refill
+ * handler or here, continues a sequential run: the window doubles, up to
+ * vm_faultaround_max pages. Any other fault closes it. The fast refill
+ * handler sends faults that continue a run here rather than handling them
+ * itself.
+ *
+ * Only pages the fast path would load are mapped: resident ones that have
+ * been used since the clock hand passed, so the clock still sees which pages
+ * are in use. Mapping stops at the first page that is not, and at the end of
+ * the faulting page's leaf table. Call with as->as_lock held.
+ */
+static void vm_faultaround(struct addrspace *as, vaddr_t vaddr) {
+    struct tlbcpu *tc;
+    struct vm_utlbcpu *uc;
+    paddr_t *pte;
+    vaddr_t next;
+    unsigned i;
+
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+    tc = vm_tlbcpu();
+    uc = &vm_utlbcpu[curcpu->c_number];
+    vaddr &= PAGE_FRAME;
+
+    if (vaddr == uc->uc_seq && vm_faultaround_max > 0) {
+        tc->tc_window = tc->tc_window == 0 ? 1 : tc->tc_window * 2;
+        if (tc->tc_window > vm_faultaround_max) {
+            tc->tc_window = vm_faultaround_max;
+        }
+    } else {
+        tc->tc_window = 0;
+    }
+
+    next = vaddr + PAGE_SIZE;
+    for (i = 0; i < tc->tc_window; i++, next += PAGE_SIZE) {
+        if (next >= USERSPACETOP) {
+            break;
+        }
+#if !OPT_HPT
+        if (PG_IDX2(KVADDR_TO_PADDR(next)) == 0) {
+            break;
+        }
+#endif
+        pte = vm_lookuppte(as, next);
+        if (pte == NULL || !PTE_RESIDENT(*pte) ||
+            (*pte & (TLBLO_VALID | PTE_REFERENCED)) !=
+            (TLBLO_VALID | PTE_REFERENCED)) {
+            break;
+        }
+        vm_tlbload(next, PTE_TO_TLBLO(*pte));
+    }
+
+    if (i > 0) {
+        tc->tc_aroundfaults++;
+        tc->tc_aroundloads += i;
+    }
+    uc->uc_seq = vm_faultaround_max > 0 ? next : 0;
+}
+
+/**
+ * Handles a write to a read-only page.
+ *
+ * Writeable pages are mapped read-only until their first write so that it
+ * can be recorded; such a page is simply marked modified.
+ *
+ * Otherwise this is only legal if the page is marked copy-on-write. If other
+ * address spaces still share the frame, the page is copied into a private
+ * frame and the shared reference is dropped; a page still mapping the zero
+ * page just gets a zeroed one from the zero pool. The last sharer simply takes the frame
+ * over. Either way the page becomes writeable again.
+ */
+static int vm_writefault(struct addrspace *as, vaddr_t faultaddress) {
+    struct tlbbatch tb;
+    paddr_t *pte;
+    paddr_t entry;
+    vaddr_t old_frame;
+    vaddr_t new_frame;
+
+    // Page must already be mapped for it to be read-only.
+    pte = vm_lookuppte(as, faultaddress);
+    if (pte == NULL) {
+        return EFAULT;
+    }
+
+    spinlock_acquire(&as->as_lock);
+    entry = vm_waitpte(as, pte);
+
+    // Page was paged out since the TLB entry was loaded, just fault again.
+    if (!PTE_RESIDENT(entry)) {
+        spinlock_release(&as->as_lock);
+        return 0;
+    }
+
+    // First write to a writeable page.
+    if ((entry & TLBLO_DIRTY) != 0) {
+        *pte = entry | PTE_MODIFIED | PTE_REFERENCED;
+        vm_tlbload(faultaddress & PAGE_FRAME, PTE_TO_TLBLO(*pte));
+        spinlock_release(&as->as_lock);
+        vmstat_inc(VMSTAT_MODIFY_FAULTS);
+        return 0;
+    }
+    spinlock_release(&as->as_lock);
+
+    if ((entry & PTE_COW) == 0) {
+        return EFAULT;
+    }
+
+    old_frame = PADDR_TO_KVADDR(entry & PAGE_FRAME);
+
+    // Copy the page if someone else still shares the frame.
+    if (kpages_refcount(old_frame) > 1) {
+        if (old_frame == vm_zeropage) {
+            new_frame = alloc_zeroed_upage(as, faultaddress);
+        } else {
+            new_frame = alloc_upage(as, faultaddress);
+        }
+        if (new_frame == 0) {
+            return ENOMEM;
+        }
+
+        if (old_frame != vm_zeropage) {
+            memcpy((void *)new_frame, (void *)old_frame, PAGE_SIZE);
+            vmstat_inc(VMSTAT_COW_BREAKS);
+        } else {
+            vmstat_inc(VMSTAT_ZERO_FILLS);
+        }
+
+        // The lock was dropped to allocate and copy, and the old frame may
+        // have become ours alone and been paged out meanwhile. If so, fault
+        // again.
+        spinlock_acquire(&as->as_lock);
+        if (*pte != entry) {
+            spinlock_release(&as->as_lock);
+            free_kpages(new_frame);
+            return 0;
+        }
+        *pte = KVADDR_TO_PADDR(new_frame) | (entry & ~PAGE_FRAME & ~PTE_COW) |
+            TLBLO_DIRTY | PTE_MODIFIED | PTE_REFERENCED;
+        spinlock_release(&as->as_lock);
+        unpin_upage(new_frame);
+
+        // Other CPUs may still map the old frame. Once they have all dropped
+        // it the write is retried and the fast path loads the new one.
+        vm_tlbbatch_init(&tb, as);
+        vm_tlbbatch_add(&tb, faultaddress);
+        vm_tlbbatch_flush(&tb);
+
+        // Drop our mapping of the shared frame.
+        free_upage(old_frame, as, faultaddress);
+        return 0;
+    }
+
+    // Last sharer, the page is now private so it can be written. The reverse
+    // map already has this as the frame's only mapping, so it can be evicted
+    // again, so look at the entry afresh: if the frame was paged out
+    // meanwhile, just fault again.
+    spinlock_acquire(&as->as_lock);
+    entry = vm_waitpte(as, pte);
+    if (!PTE_RESIDENT(entry) || (entry & PTE_COW) == 0 ||
+        PADDR_TO_KVADDR(entry & PAGE_FRAME) != old_frame) {
+        spinlock_release(&as->as_lock);
+        return 0;
+    }
+    *pte = (entry & ~PTE_COW) | TLBLO_DIRTY | PTE_MODIFIED | PTE_REFERENCED;
+    vm_tlbload(faultaddress & PAGE_FRAME, PTE_TO_TLBLO(*pte));
+    spinlock_release(&as->as_lock);
+
+    vmstat_inc(VMSTAT_COW_BREAKS);
+
+    return 0;
+}
+
+/**
+ * Finds the pages following vaddr in as that were written to the swap slots
+ * following slot, in the same cluster, and are still swapped out there, and
+ * allocates frames to read them into along with the faulting page. Stops at
+ * the first page that is not, or when free memory runs short. Fills in the
+ * frames, entries and page table entries of the pages and returns how many
+ * there are.
+ */
+static unsigned vm_swapahead(struct addrspace *as, vaddr_t vaddr,
+                             unsigned slot, vaddr_t *frames, paddr_t *entries,
+                             paddr_t **ptes) {
+    unsigned max;
+    unsigned n;
+    paddr_t entry;
+    paddr_t *pte;
+
+    max = swap_cluster;
+    if (max > SWAP_CLUSTER_MAX) {
+        max = SWAP_CLUSTER_MAX;
+    }
+
+    vaddr &= PAGE_FRAME;
+    for (n = 0; n + 1 < max; n++) {
+        vaddr += PAGE_SIZE;
+        if (vaddr >= USERSPACETOP) {
+            break;
+        }
+
+        pte = vm_lookuppte(as, vaddr);
+        if (pte == NULL) {
+            break;
+        }
+
+        spinlock_acquire(&as->as_lock);
+        entry = *pte;
+        spinlock_release(&as->as_lock);
+        if ((entry & (PTE_SWAPPED | PTE_PAGING)) != PTE_SWAPPED ||
+            PTE_TO_SWAP_SLOT(entry) != slot + n + 1) {
+            break;
+        }
+
+        frames[n] = alloc_upage_ahead(as, vaddr);
+        if (frames[n] == 0) {
+            break;
+        }
+        entries[n] = entry;
+        ptes[n] = pte;
+    }
+
+    return n;
+}
+
+/**
+ * Reads a swapped out page back into a newly allocated frame and frees its
+ * swap slot. Copy-on-write pages come back private and writeable since the
+ * swapped copy was never shared. Having lost its swap copy, the page counts as
+ * modified.
+ *
+ * The pages written after it in the same swap cluster, if they are still
+ * swapped out, are read in by the same request. They are left unreferenced,
+ * so the clock takes them back first if they turn out not to be wanted.
+ */
+static int vm_swapin(struct addrspace *as, paddr_t *pte, vaddr_t vaddr,
+                     paddr_t entry) {
+    vaddr_t frames[SWAP_CLUSTER_MAX];
+    paddr_t entries[SWAP_CLUSTER_MAX];
+    paddr_t *ptes[SWAP_CLUSTER_MAX];
+    unsigned slot;
+    unsigned npages;
+    unsigned i;
+    int result;
+
+    slot = PTE_TO_SWAP_SLOT(entry);
+
+    frames[0] = alloc_upage(as, vaddr);
+    if (frames[0] == 0) {
+        return ENOMEM;
+    }
+    entries[0] = entry;
+    ptes[0] = pte;
+
+    npages = 1 + vm_swapahead(as, vaddr, slot, frames + 1, entries + 1,
+                              ptes + 1);
+
+    result = swap_in_cluster(slot, frames, npages);
+    if (result != 0) {
+        for (i = 0; i < npages; i++) {
+            free_kpages(frames[i]);
+        }
+        return result;
+    }
+
+    for (i = 0; i < npages; i++) {
+        // A page read ahead may have been freed or changed meanwhile; then
+        // its slot is no longer ours either.
+        spinlock_acquire(&as->as_lock);
+        if (i > 0 && *ptes[i] != entries[i]) {
+            spinlock_release(&as->as_lock);
+            free_kpages(frames[i]);
+            continue;
+        }
+        *ptes[i] = KVADDR_TO_PADDR(frames[i]) | TLBLO_VALID | PTE_MODIFIED |
+            (i == 0) * PTE_REFERENCED |
+            (((entries[i] & (TLBLO_DIRTY | PTE_COW)) != 0) * TLBLO_DIRTY);
+        spinlock_release(&as->as_lock);
+
+        unpin_upage(frames[i]);
+        swap_free(slot + i);
+        vmstat_inc(VMSTAT_SWAPINS);
+        if (i > 0) {
+            vmstat_inc(VMSTAT_SWAP_READAHEAD);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Clears the referenced bit of the page at vaddr in as and returns whether it
+ * was set, for the clock algorithm. The TLB entry is dropped as well so the
+ * next access faults and vm_fault() sets the bit again.
+ *
+ * Only this CPU's entry is dropped. Shooting down the others on every sweep
+ * would cost far more than the occasional page wrongly thought unused, and
+ * the bit is only a hint; vm_pageout_shootdown() makes eviction safe.
+ *
+ * Called with the frame table lock held. Returns 0 if the entry no longer
+ * maps the frame at paddr.
+ */
+int vm_pageref(struct addrspace *as, vaddr_t vaddr, paddr_t paddr) {
+    paddr_t *pte;
+    int referenced;
+
+    pte = vm_lookuppte(as, vaddr);
+    if (pte == NULL) {
+        return 0;
+    }
+
+    spinlock_acquire(&as->as_lock);
+
+    referenced = PTE_RESIDENT(*pte) && (*pte & PAGE_FRAME) == paddr &&
+        (*pte & PTE_REFERENCED) != 0;
+    if (referenced) {
+        *pte &= ~PTE_REFERENCED;
+        vm_tlbinvalidate(as, vaddr);
+    }
+
+    spinlock_release(&as->as_lock);
+
+    return referenced;
+}
+
+/**
+ * Starts paging out the frame at paddr mapped at vaddr in as. The page table
+ * entry is marked as paging out so the owner waits for the write to finish
+ * if it touches the page, and the old entry is handed back. Only this CPU's
+ * TLB entry is dropped here; the caller shoots down the others with
+ * vm_pageout_shootdown() once it has released the lock.
+ *
+ * Called with the frame table lock held. Fails with EBUSY if the entry no
+ * longer maps the frame.
+ */
+int vm_pageout_begin(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+                     paddr_t *oldpte) {
+    paddr_t *pte;
+
+    pte = vm_lookuppte(as, vaddr);
+    if (pte == NULL) {
+        return EBUSY;
+    }
+
+    spinlock_acquire(&as->as_lock);
+
+    if (!PTE_RESIDENT(*pte) || (*pte & PAGE_FRAME) != paddr) {
+        spinlock_release(&as->as_lock);
+        return EBUSY;
+    }
+
+    *oldpte = *pte;
+    *pte = paddr | PTE_PAGING;
+    vm_tlbinvalidate(as, vaddr);
+
+    spinlock_release(&as->as_lock);
 
     return 0;
 }
 
+/**
+ * Drops the page at vaddr, being paged out by vm_pageout_begin(), from the
+ * TLBs of other CPUs. Called once the frame table lock is released and before
+ * the frame is written out or reused.
+ */
+void vm_pageout_shootdown(struct addrspace *as, vaddr_t vaddr) {
+    struct tlbbatch tb;
+
+    vm_tlbbatch_init(&tb, as);
+    vm_tlbbatch_add(&tb, vaddr);
+    vm_tlbbatch_flush(&tb);
+}
+
+/**
+ * Finishes paging out a page by installing its new page table entry, which is
+ * either a swap entry or the old entry if the write failed, and wakes anyone
+ * waiting on it.
+ */
+void vm_pageout_end(struct addrspace *as, vaddr_t vaddr, paddr_t pte) {
+    paddr_t *entry;
+
+    entry = vm_lookuppte(as, vaddr);
+    KASSERT(entry != NULL);
+
+    spinlock_acquire(&as->as_lock);
+    KASSERT((*entry & PTE_PAGING) != 0);
+    *entry = pte;
+    if (pte == 0) {
+        vm_ptecount(as, vaddr, -1);
+    }
+    wchan_wakeall(as->as_wchan, &as->as_lock);
+    spinlock_release(&as->as_lock);
+}
+
+/**
+ * Returns whether any of the page at vaddr in region r is backed by the
+ * region's file, i.e. whether it cannot simply be zero-filled.
+ */
+static int vm_hasfiledata(struct region *r, vaddr_t vaddr) {
+    vaddr_t start;
+
+    if (r->vn == NULL) {
+        return 0;
+    }
+
+    start = vaddr & PAGE_FRAME;
+    return start < r->file_vaddr + r->file_size &&
+        start + PAGE_SIZE > r->file_vaddr;
+}
+
+/**
+ * Reads the part of a file backed region's page at vaddr that is covered by
+ * the file into the frame at pfn. The frame must already be zero-filled, so
+ * anything past the file data (BSS) is left as zeroes.
+ */
+static int vm_readpage(struct region *r, vaddr_t vaddr, paddr_t pfn) {
+    struct iovec iov;
+    struct uio u;
+    vaddr_t start;
+    vaddr_t end;
+    int result;
+
+    // Clip the page to the file backed part of the region.
+    start = vaddr & PAGE_FRAME;
+    end = start + PAGE_SIZE;
+    if (start < r->file_vaddr) {
+        start = r->file_vaddr;
+    }
+    if (end > r->file_vaddr + r->file_size) {
+        end = r->file_vaddr + r->file_size;
+    }
+
+    // Page is entirely zero-fill.
+    if (start >= end) {
+        return 0;
+    }
+
+    uio_kinit(&iov, &u, (void *)(PADDR_TO_KVADDR(pfn) + (start & ~PAGE_FRAME)),
+              end - start, r->file_offset + (start - r->file_vaddr), UIO_READ);
+
+    result = VOP_READ(r->vn, &u);
+    if (result != 0) {
+        return result;
+    }
+
+    // Executable was truncated after it was loaded. A mapped file may
+    // shrink while it is mapped, the rest of the page just stays zero.
+    if (u.uio_resid != 0 && !r->mapped) {
+        return ENOEXEC;
+    }
+
+    return 0;
+}
+
+/**
+ * Maps the page at pte of a read-only executable segment to the frame shared
+ * by every process running the executable, reading it in first if no process
+ * has touched the page yet.
+ */
+static int vm_maptext(struct addrspace *as, struct region *r, paddr_t *pte,
+                      vaddr_t vaddr) {
+    vaddr_t frame;
+    int result;
+
+    frame = textfile_lookup(r->text, as, vaddr);
+    if (frame == 0) {
+        frame = alloc_zeroed_upage(as, vaddr);
+        if (frame == 0) {
+            return ENOMEM;
+        }
+
+        result = vm_readpage(r, vaddr, KVADDR_TO_PADDR(frame));
+        if (result != 0) {
+            free_kpages(frame);
+            return result;
+        }
+
+        // Nothing maps the frame yet, so it cannot be paged out unpinned.
+        unpin_upage(frame);
+        frame = textfile_insert(r->text, as, vaddr, frame);
+        vmstat_inc(VMSTAT_PAGEINS);
+    }
+
+    spinlock_acquire(&as->as_lock);
+    *pte = KVADDR_TO_PADDR(frame) | GET_VALID_BIT(r->cur_perm) |
+        PTE_REFERENCED;
+    vm_ptecount(as, vaddr, 1);
+    spinlock_release(&as->as_lock);
+
+    return 0;
+}
+
+/**
+ * Writes the part of a mapped region's page at vaddr that is covered by the
+ * file from the frame at pfn back to the file. The mapping never extends the
+ * file.
+ */
+static int vm_writepage(struct region *r, vaddr_t vaddr, paddr_t pfn) {
+    struct iovec iov;
+    struct uio u;
+    vaddr_t start;
+    vaddr_t end;
+
+    // Clip the page to the file backed part of the region.
+    start = vaddr & PAGE_FRAME;
+    end = start + PAGE_SIZE;
+    if (start < r->file_vaddr) {
+        start = r->file_vaddr;
+    }
+    if (end > r->file_vaddr + r->file_size) {
+        end = r->file_vaddr + r->file_size;
+    }
+
+    if (start >= end) {
+        return 0;
+    }
+
+    uio_kinit(&iov, &u, (void *)(PADDR_TO_KVADDR(pfn) + (start & ~PAGE_FRAME)),
+              end - start, r->file_offset + (start - r->file_vaddr), UIO_WRITE);
+
+    return VOP_WRITE(r->vn, &u);
+}
+
+/**
+ * Writes the page at vaddr of mapped region r back to the file if it has been
+ * modified, and marks it clean again. A modified page that was paged out is
+ * read back in from swap first.
+ *
+ * While the write is in progress the entry is marked as paging out, which
+ * keeps the frame from being evicted and makes any access wait, so no write
+ * to the page can be lost.
+ */
+int vm_writeback(struct addrspace *as, struct region *r, vaddr_t vaddr) {
+    struct tlbbatch tb;
+    paddr_t *pte;
+    paddr_t entry;
+    int result;
+
+    KASSERT(r->mapped && r->vn != NULL);
+
+    vaddr &= PAGE_FRAME;
+    pte = vm_lookuppte(as, vaddr);
+    if (pte == NULL) {
+        return 0;
+    }
+
+    while (1) {
+        spinlock_acquire(&as->as_lock);
+        entry = vm_waitpte(as, pte);
+        if (PTE_RESIDENT(entry)) {
+            break;
+        }
+        spinlock_release(&as->as_lock);
+
+        // Never touched, or dropped because it was clean.
+        if ((entry & PTE_SWAPPED) == 0) {
+            return 0;
+        }
+
+        result = vm_swapin(as, pte, vaddr, entry);
+        if (result != 0) {
+            return result;
+        }
+    }
+
+    if ((entry & PTE_MODIFIED) == 0) {
+        spinlock_release(&as->as_lock);
+        return 0;
+    }
+
+    *pte = (entry & PAGE_FRAME) | PTE_PAGING;
+    spinlock_release(&as->as_lock);
+
+    // No CPU may write the page through an old translation while it is
+    // written out, or the write could be lost when it is marked clean.
+    vm_tlbbatch_init(&tb, as);
+    vm_tlbbatch_add(&tb, vaddr);
+    vm_tlbbatch_flush(&tb);
+
+    result = vm_writepage(r, vaddr, entry & PAGE_FRAME);
+
+    // Clean pages are write-protected in the TLB, so the next write marks the
+    // page modified again.
+    spinlock_acquire(&as->as_lock);
+    *pte = result == 0 ? entry & ~PTE_MODIFIED : entry;
+    wchan_wakeall(as->as_wchan, &as->as_lock);
+    spinlock_release(&as->as_lock);
+
+    return result;
+}
 
 void vm_bootstrap(void) {
-    /* Initialise any global components of your VM sub-system here.  
-     *  
-     * You may or may not need to add anything here depending what's
-     * provided or required by the assignment spec.
-     */
+    unsigned i;
+
+    // ASID generations start at 1, leaving context 0 for none.
+    for (i = 0; i < VM_CPUS; i++) {
+        tlb_cpu[i].tc_generation = 1;
+    }
+
+#if OPT_HPT
+    hpt_bootstrap();
+#else
+    vm_nodecache = ptcache_create("pgnode", sizeof(struct pgnode));
+    vm_tablecache = ptcache_create("pgtable", PG_SIZE_2 * sizeof(paddr_t));
+    if (vm_nodecache == NULL || vm_tablecache == NULL) {
+        panic("vm: no memory for the page table caches\n");
+    }
+#endif
+    swap_bootstrap();
+    rmap_bootstrap();
+
+    vm_zeropage = alloc_kpages(1);
+    if (vm_zeropage == 0) {
+        panic("vm: no memory for the zero page\n");
+    }
+    bzero((void *)vm_zeropage, PAGE_SIZE);
+
+    pageout_bootstrap();
 }
 
 /**
- * 
+ * Handles a TLB miss or a write to a read-only page.
+ *
+ * Missing pages are allocated (and read in from the backing file if there is
+ * one) or paged back in from swap before the translation is loaded into the
+ * TLB. A read of a page that would only be zero-filled maps the shared zero
+ * page instead, leaving the allocation to the first write, and pages of
+ * read-only executable segments map the frames cached for the executable.
  */
 int vm_fault(int faulttype, vaddr_t faultaddress) {
     struct addrspace *as;
     struct region *r;
-    paddr_t **pte1;
+#if OPT_HPT
+    int allocated_pte_flag;
+#else
+    struct pgnode *pte1;
     paddr_t *pte2;
+    int allocated_pte1_flag;
+    int allocated_pte2_flag;
+#endif
+    paddr_t *pte;
     paddr_t pte3;
     paddr_t paddr;
-    int spl;
     int entry_hi;
-    int entry_lo;
     int result;
-    int allocated_pte1_flag;
-    int allocated_pte2_flag;
 
     // Set flags to false.
+#if OPT_HPT
+    allocated_pte_flag = 0;
+#else
     allocated_pte1_flag = 0;
     allocated_pte2_flag = 0;
+#endif
+
+    vmstat_inc(VMSTAT_TLB_FAULTS);
 
     // Sanity check curproc.
     if (curproc == NULL) {
@@ -133,14 +1346,16 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
     }
 
     // Sanity check address space's regions.
-    if (as->regions == NULL) {
+    if (regionarray_num(&as->regions) == 0) {
         return EFAULT;
     }
 
+#if !OPT_HPT
     // Sanity check address space's page table.
     if (as->pgtable == NULL) {
         return EFAULT;
     }
+#endif
 
     // Check faulttype is valid.
     switch (faulttype) {
@@ -149,7 +1364,7 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
         case VM_FAULT_WRITE:
             break;
         case VM_FAULT_READONLY:
-            return EFAULT;
+            return vm_writefault(as, faultaddress);
         default:
             return EINVAL;
     }
@@ -157,6 +1372,18 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
     // Get physical address.
     paddr = KVADDR_TO_PADDR(faultaddress);
 
+#if OPT_HPT
+    // Add a hashed page table entry if the page has none.
+    pte = hpt_lookup(as, faultaddress);
+    if (pte == NULL) {
+        result = hpt_insert(as, faultaddress, &pte);
+        if (result != 0) {
+            goto cleanupA;
+        }
+
+        allocated_pte_flag = 1;
+    }
+#else
     // Allocate 1st level page table entry if root entry is NULL.
     pte1 = as->pgtable[PG_IDX0(paddr)];
     if (pte1 == NULL) {
@@ -169,7 +1396,7 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
     }
 
     // Allocate 2nd level page table entry if entry was not found.
-    pte2 = as->pgtable[PG_IDX0(paddr)][PG_IDX1(paddr)];
+    pte2 = as->pgtable[PG_IDX0(paddr)]->pn_table[PG_IDX1(paddr)];
     if (pte2 == NULL) {
         result = vm_allocpte2(as, paddr);
         if (result != 0) {
@@ -179,75 +1406,213 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
         allocated_pte2_flag = 1;
     }
 
+    pte = &as->pgtable[PG_IDX0(paddr)]->pn_table[PG_IDX1(paddr)][PG_IDX2(paddr)];
+#endif
+
+    // Wait out a page out in progress before looking at the entry.
+    spinlock_acquire(&as->as_lock);
+    pte3 = vm_waitpte(as, pte);
+    spinlock_release(&as->as_lock);
+
     // Allocate 3rd level page table entry.
-    pte3 = as->pgtable[PG_IDX0(paddr)][PG_IDX1(paddr)][PG_IDX2(paddr)];
     if (pte3 == 0) {
         r = search_region(as, faultaddress, 0);
+        if (r == NULL) {
+            // Maybe just below the stack, which grows on demand.
+            r = as_growstack(as, faultaddress);
+        }
         if (r == NULL) {
             result = EFAULT;
             goto cleanupC;
         }
 
-        result = vm_allocpte3(as, paddr, r->cur_perm);
+        if (faulttype == VM_FAULT_READ && !vm_hasfiledata(r, faultaddress)) {
+            result = vm_mapzero(as, pte, faultaddress, r->cur_perm);
+            if (result != 0) {
+                goto cleanupC;
+            }
+        } else if (r->text != NULL && vm_hasfiledata(r, faultaddress)) {
+            result = vm_maptext(as, r, pte, faultaddress);
+            if (result != 0) {
+                goto cleanupC;
+            }
+        } else {
+            result = vm_allocpte3(as, paddr, r->cur_perm);
+            if (result != 0) {
+                goto cleanupC;
+            }
+            pte3 = *pte;
+
+            // Page in from the backing file.
+            if (r->vn != NULL) {
+                result = vm_readpage(r, faultaddress, pte3 & PAGE_FRAME);
+                if (result != 0) {
+                    spinlock_acquire(&as->as_lock);
+                    *pte = 0;
+                    vm_ptecount(as, faultaddress, -1);
+                    spinlock_release(&as->as_lock);
+                    free_kpages(PADDR_TO_KVADDR(pte3 & PAGE_FRAME));
+                    goto cleanupC;
+                }
+            }
+
+            unpin_upage(PADDR_TO_KVADDR(pte3 & PAGE_FRAME));
+            vmstat_inc(vm_hasfiledata(r, faultaddress) ?
+                       VMSTAT_PAGEINS : VMSTAT_ZERO_FILLS);
+        }
+    } else if ((pte3 & PTE_SWAPPED) != 0) {
+        result = vm_swapin(as, pte, faultaddress, pte3);
         if (result != 0) {
-            goto cleanupC;
+            goto cleanupA;
         }
     }
 
-    // Get entry high and entry low.
+    // Get entry high.
     entry_hi = faultaddress & PAGE_FRAME;
-    entry_lo = as->pgtable[PG_IDX0(paddr)][PG_IDX1(paddr)][PG_IDX2(paddr)];
 
-    // Add pagetable entry randomly to the TLB.
-    spl = splhigh();
-    tlb_random(entry_hi, entry_lo);
-    splx(spl);
+    // Add pagetable entry to the TLB, unless it was paged out again already
+    // in which case the access simply faults again. The page is marked used
+    // for the clock algorithm, and a write to a writeable page marks it
+    // modified up front.
+    spinlock_acquire(&as->as_lock);
+    pte3 = *pte;
+    if (PTE_RESIDENT(pte3)) {
+        pte3 |= PTE_REFERENCED;
+        if (faulttype == VM_FAULT_WRITE && (pte3 & TLBLO_DIRTY) != 0) {
+            pte3 |= PTE_MODIFIED;
+        }
+        *pte = pte3;
+        vm_tlbload(entry_hi, PTE_TO_TLBLO(pte3));
+        vm_faultaround(as, entry_hi);
+    }
+    spinlock_release(&as->as_lock);
 
     // Success
     result = 0;
     goto cleanupA;
 
 cleanupC:
+#if OPT_HPT
+    // Undo hashed page table entry after failure.
+    if (allocated_pte_flag == 1) {
+        hpt_remove(as, faultaddress);
+    }
+#else
     // Undo pte2 memory allocation after failure.
-    if (allocated_pte2_flag == 1 && pte2 != NULL) {
-        kfree(pte2);
-        pte2 = NULL;
+    if (allocated_pte2_flag == 1) {
+        vm_freepte2(as, paddr);
     }
 
 cleanupB:
     // Undo pte1 memory allocation after failure.
-    if (allocated_pte1_flag == 1 && pte1 != NULL) {
-        kfree(pte1);
-        pte1 = NULL;
+    if (allocated_pte1_flag == 1) {
+        vm_freepte1(as, paddr);
     }
+#endif
 
 cleanupA:
     return result;
 }
 
-/*
- * SMP-specific functions.  Unused in our UNSW configuration.
+/**
+ * Handles a shootdown sent by vm_tlbbatch_flush() on another CPU: drops the
+ * batch from this CPU's TLB and lets the sender know. Called from the IPI
+ * handler, so interrupts are already off.
  */
-
 void vm_tlbshootdown(const struct tlbshootdown *ts) {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+    struct tlbbatch *tb;
+
+    tb = ts->ts_batch;
+    vm_tlbdropbatch(tb);
+    vm_tlbcpu()->tc_shootdowns++;
+
+    spinlock_acquire(&tlb_shootdown_lock);
+    tb->tb_pending &= ~((uint32_t)1 << curcpu->c_number);
+    spinlock_release(&tlb_shootdown_lock);
 }
 
 /**
  * TLB is flushed to protect process memory from access by other processes.
+ * With ASIDs this is only needed when they wrap around.
  * 
- * TLB is flushed by writing invalid data to TLB.
+ * TLB is flushed by writing invalid data to TLB. Only this CPU's TLB is
+ * flushed.
  * 
  * Uses NUM_TLB, tlb_write(), TLBHI_INVALID(), and TLBLO_INVALID from tlb.h.
  */
 void vm_tlbflush(void) {
+    struct tlbcpu *tc;
     int i;
     int spl;
 
     spl = splhigh();
+    tc = vm_tlbcpu();
     for (i = 0; i < NUM_TLB; i++) {
         tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
     }
+    tlb_setpid(ASID_TO_TLBHI(CONTEXT_ASID(tc->tc_context)));
+
+    // Every slot is free, and the hand finds them in order.
+    tc->tc_nholes = 0;
+    vm_utlbcpu[curcpu->c_number].uc_next = 0;
     splx(spl);
+    vmstat_inc(VMSTAT_TLB_FLUSHES);
+}
+
+void vm_tlbprintstats(void) {
+    struct tlbcpu total;
+    struct tlbcpu *tc;
+    struct vmstat vs;
+    unsigned refills;
+    unsigned rollovers;
+    unsigned i;
+
+    bzero(&total, sizeof(total));
+    refills = rollovers = 0;
+    for (i = 0; i < VM_CPUS; i++) {
+        tc = &tlb_cpu[i];
+        total.tc_loads += tc->tc_loads;
+        total.tc_updates += tc->tc_updates;
+        total.tc_fills += tc->tc_fills;
+        total.tc_evictions += tc->tc_evictions;
+        total.tc_shootdowns += tc->tc_shootdowns;
+        total.tc_aroundfaults += tc->tc_aroundfaults;
+        total.tc_aroundloads += tc->tc_aroundloads;
+        refills += vm_utlbcpu[i].uc_refills;
+        rollovers += tc->tc_generation > 1 ? tc->tc_generation - 1 : 0;
+    }
+
+    vmstat_total(&vs);
+    kprintf("tlb: %u translations loaded, %u fast refills, %llu full flushes, "
+            "%u ASID rollovers\n", total.tc_loads, refills,
+            (unsigned long long)vs.vs_count[VMSTAT_TLB_FLUSHES], rollovers);
+    kprintf("tlb: %u updated in place, %u into free slots, %u evictions\n",
+            total.tc_updates, total.tc_fills, total.tc_evictions);
+
+    kprintf("tlb: fault-around mapped %u pages ahead in %u faults, window "
+            "up to %u pages\n", total.tc_aroundloads, total.tc_aroundfaults,
+            vm_faultaround_max);
+
+    spinlock_acquire(&tlb_shootdown_lock);
+    kprintf("tlb: %u shootdowns to %u CPUs, %u pages and %u whole address "
+            "spaces, %u handled\n", tlb_shootdowns, tlb_shootipis,
+            tlb_shootpages, tlb_shootspaces, total.tc_shootdowns);
+    if (tlb_shootdowns > 0) {
+        kprintf("tlb: shootdowns took %u ns on average, %u ns at most, "
+                "%u sends retried on a full queue\n",
+                (unsigned)(tlb_shootns / tlb_shootdowns), tlb_shootmaxns,
+                tlb_shootresends);
+    }
+    spinlock_release(&tlb_shootdown_lock);
+
+    // CPUs that have done anything with their TLB.
+    for (i = 0; i < VM_CPUS; i++) {
+        tc = &tlb_cpu[i];
+        if (tc->tc_loads > 0 || tc->tc_shootdowns > 0) {
+            kprintf("    cpu%u: %u loaded, %u fast refills, %u evictions, "
+                    "%u shootdowns handled\n", i, tc->tc_loads,
+                    vm_utlbcpu[i].uc_refills, tc->tc_evictions,
+                    tc->tc_shootdowns);
+        }
+    }
 }
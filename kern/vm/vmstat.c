@@ -0,0 +1,92 @@
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <proc.h>
+#include <current.h>
+#include <vm.h>
+#include <vmstat.h>
+
+// Counters of each CPU. Only written by their own CPU with interrupts off.
+static struct vmstat vmstat_cpu[VM_CPUS];
+
+static const char *const vmstat_names[VMSTAT_NUM] = VMSTAT_NAMES;
+
+/**
+ * Counts n events of kind which on the current CPU and in the current
+ * process.
+ *
+ * Nothing is locked: interrupts are turned off so that the 64-bit increments
+ * cannot be torn on this CPU, and no other CPU writes the same slot. A
+ * process's counters are only exact while it runs on one CPU at a time.
+ * Before the CPU structures exist only the boot CPU is running, so slot 0 is
+ * used.
+ */
+void vmstat_add(unsigned which, unsigned n) {
+    unsigned cpu;
+    int spl;
+
+    KASSERT(which < VMSTAT_NUM);
+
+    spl = splhigh();
+    cpu = CURCPU_EXISTS() ? curcpu->c_number : 0;
+    KASSERT(cpu < VM_CPUS);
+    vmstat_cpu[cpu].vs_count[which] += n;
+    if (CURCPU_EXISTS() && curproc != NULL) {
+        curproc->p_vmstat.vs_count[which] += n;
+    }
+    splx(spl);
+}
+
+/**
+ * Sums the counters of all CPUs. Other CPUs keep counting meanwhile, so the
+ * totals are a snapshot that may be slightly behind.
+ */
+void vmstat_total(struct vmstat *vs) {
+    unsigned i, j;
+
+    bzero(vs, sizeof(*vs));
+    for (i = 0; i < VM_CPUS; i++) {
+        for (j = 0; j < VMSTAT_NUM; j++) {
+            vs->vs_count[j] += vmstat_cpu[i].vs_count[j];
+        }
+    }
+
+    // The fast refill handler keeps its own count on each CPU.
+    for (i = 0; i < VM_CPUS; i++) {
+        vs->vs_count[VMSTAT_TLB_REFILLS] += vm_utlbcpu[i].uc_refills;
+    }
+}
+
+void vmstat_printstats(void) {
+    struct vmstat total;
+    unsigned i, j;
+    int used;
+
+    vmstat_total(&total);
+    for (j = 0; j < VMSTAT_NUM; j++) {
+        kprintf("%-18s %llu\n", vmstat_names[j],
+                (unsigned long long)total.vs_count[j]);
+    }
+
+    // Per-CPU breakdown of the non-zero counters.
+    for (i = 0; i < VM_CPUS; i++) {
+        used = 0;
+        for (j = 0; j < VMSTAT_NUM; j++) {
+            if (vmstat_cpu[i].vs_count[j] == 0) {
+                continue;
+            }
+            if (used) {
+                kprintf(",");
+            } else {
+                kprintf("cpu%u:", i);
+            }
+            kprintf(" %s %llu", vmstat_names[j],
+                    (unsigned long long)vmstat_cpu[i].vs_count[j]);
+            used = 1;
+        }
+        if (used) {
+            kprintf("\n");
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <sys/vmstat.h>
+
+/*
+ * vmstat - print virtual memory event counters.
+ * Usage: vmstat [-s]
+ *
+ * Prints the counters of the whole system, or with -s those of the
+ * vmstat process itself. Uses the __vmstat system call.
+ */
+
+static const char *const names[VMSTAT_NUM] = VMSTAT_NAMES;
+
+int
+main(int argc, char *argv[])
+{
+	struct vmstat vs;
+	int who, i;
+
+	if (argc == 1) {
+		who = VMSTAT_ALL;
+	}
+	else if (argc == 2 && !strcmp(argv[1], "-s")) {
+		who = VMSTAT_SELF;
+	}
+	else {
+		errx(1, "Usage: vmstat [-s]");
+	}
+
+	if (__vmstat(who, &vs) < 0) {
+		err(1, "__vmstat");
+	}
+
+	for (i = 0; i < VMSTAT_NUM; i++) {
+		printf("%-18s %llu\n", names[i],
+		       (unsigned long long)vs.vs_count[i]);
+	}
+	return 0;
+}